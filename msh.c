@@ -5,374 +5,8106 @@
   @brief        MSH (M SHell)
 *******************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sched.h>
+#include <signal.h>
+#include <termios.h>
 #include <unistd.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdio_ext.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+  Function Declarations for builtin shell commands:
+ */
+int msh_cd(char** args);
+int msh_pushd(char** args);
+int msh_popd(char** args);
+int msh_dirs(char** args);
+int msh_help(char** args);
+int msh_exit(char** args);
+int msh_pwd(char** args);
+int msh_hash(char** args);
+int msh_jobs_builtin(char** args);
+int msh_wait(char** args);
+int msh_fg(char** args);
+int msh_bg(char** args);
+int msh_parallel(char** args);
+int msh_stats(char** args);
+int msh_tee(char** args);
+int msh_set(char** args);
+int msh_true(char** args);
+int msh_false(char** args);
+int msh_echo(char** args);
+int msh_printf(char** args);
+int msh_test(char** args);
+int msh_alias(char** args);
+int msh_unalias(char** args);
+int msh_unset(char** args);
+int msh_export(char** args);
+int msh_shift(char** args);
+
+/*
+  Shell variables, kept in the symbol table with aliases and functions.
+ */
+#define MSH_VAR_KEEP   0   // leave whether the variable is exported
+#define MSH_VAR_EXPORT 1   // export it
+
+const char* msh_var_get(const char* name);
+const char* msh_var_getn(const char* name, size_t len);
+void msh_var_set(const char* name, const char* value, int export);
+int msh_var_assign(const char* assign, int export);
+
+unsigned msh_env_gen = 1;   // bumped whenever the environment changes
+
+/*
+  A command's NAME=value prefixes hold only while it runs, or starts: the
+  variables are set and exported around it, then put back as they were.
+ */
+struct msh_var_saved {
+   struct msh_sym* sym;
+   char* var;
+   int exported;
+   int inherited;
+};
+
+struct msh_cmd;
+struct msh_var_saved* msh_var_push(struct msh_cmd* cmd);
+void msh_var_pop(struct msh_cmd* cmd, struct msh_var_saved* saved);
+
+void msh_error_prefix(void);
+
+/*
+  Hot-path counters, compiled in with -DMSH_STATS.  Each phase counts
+  its calls and the monotonic time spent in them; without the macro the
+  hooks expand to nothing.  spawn covers the parent's side of starting a
+  stage, which with posix_spawn and vfork includes the child up to its
+  exec.
+ */
+#define MSH_ST_READ     0   // msh_read_line
+#define MSH_ST_PARSE    1   // lexing and parsing, cache misses only
+#define MSH_ST_DISPATCH 2   // builtin lookup in msh_execute
+#define MSH_ST_BUILTIN  3   // builtins run in the shell
+#define MSH_ST_LOOKUP   4   // PATH resolution
+#define MSH_ST_SPAWN    5   // starting one stage
+#define MSH_ST_WAIT     6   // blocked on a foreground job
+#define MSH_ST_COUNT    7
+
+#ifdef MSH_STATS
+struct msh_stat {
+   const char* name;
+   unsigned long calls;
+   unsigned long long ns;
+};
+
+struct msh_stat msh_stat_table[MSH_ST_COUNT] = {
+   { "read" }, { "parse" }, { "dispatch" }, { "builtin" },
+   { "lookup" }, { "spawn" }, { "wait" }
+};
+
+static inline unsigned long long msh_stat_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define MSH_STAT_BEGIN(v) unsigned long long v = msh_stat_now()
+#define MSH_STAT_END(id, v) \
+   (msh_stat_table[id].calls++, msh_stat_table[id].ns += msh_stat_now() - (v))
+#else
+#define MSH_STAT_BEGIN(v) ((void)0)
+#define MSH_STAT_END(id, v) ((void)0)
+#endif
+
+/*
+  Builtin registry.  Dispatch goes through a perfect hash: the slot of
+  each name is (FNV-1a(name) * multiplier) >> shift, with the multiplier
+  chosen once so that no two builtins share a slot.  Any name then costs
+  one hash and at most one strcmp, however many builtins there are.
+ */
+struct msh_builtin {
+   const char* name;
+   int (*func)(char**);
+   int flags;
+};
+
+// Reads no input and changes no shell state, so it can run in the shell
+// even as one stage of a pipeline.
+#define MSH_BUILTIN_PURE 1
+
+static const struct msh_builtin msh_builtins[] = {
+   { "cd", &msh_cd },
+   { "pushd", &msh_pushd },
+   { "popd", &msh_popd },
+   { "dirs", &msh_dirs },
+   { "help", &msh_help },
+   { "exit", &msh_exit },
+   { "pwd", &msh_pwd },
+   { "hash", &msh_hash },
+   { "jobs", &msh_jobs_builtin },
+   { "wait", &msh_wait },
+   { "fg", &msh_fg },
+   { "bg", &msh_bg },
+   { "parallel", &msh_parallel },
+   { "stats", &msh_stats },
+   { "tee", &msh_tee },
+   { "set", &msh_set },
+   { "true", &msh_true, MSH_BUILTIN_PURE },
+   { "false", &msh_false, MSH_BUILTIN_PURE },
+   { "echo", &msh_echo, MSH_BUILTIN_PURE },
+   { "printf", &msh_printf, MSH_BUILTIN_PURE },
+   { "test", &msh_test, MSH_BUILTIN_PURE },
+   { "[", &msh_test, MSH_BUILTIN_PURE },
+   { "alias", &msh_alias },
+   { "unalias", &msh_unalias },
+   { "unset", &msh_unset },
+   { "export", &msh_export },
+   { "shift", &msh_shift },
+};
+
+#define MSH_BUILTIN_BITS 7   // slots = 1 << bits, at least 2x the builtins
+
+static unsigned char msh_builtin_slot[1 << MSH_BUILTIN_BITS];   // index + 1
+static unsigned msh_builtin_mult;    // 0 until the table is built
+
+int msh_num_builtins() {
+   return sizeof(msh_builtins) / sizeof(struct msh_builtin);
+}
+
+/**
+   @brief FNV-1a hash of a string.
+   @param str The string.
+   @return The hash.
+ */
+unsigned msh_strhash(const char* str)
+{
+   unsigned h = 2166136261u;
+   while (*str) {
+      h = (h ^ (unsigned char)*str++) * 16777619u;
+   }
+   return h;
+}
+
+/**
+   @brief Map a name's hash to its builtin slot.
+   @param h FNV-1a hash of the name.
+   @param mult Odd multiplier.
+   @return The slot.
+ */
+static inline unsigned msh_builtin_hash(unsigned h, unsigned mult)
+{
+   return (h * mult) >> (32 - MSH_BUILTIN_BITS);
+}
+
+/**
+   @brief Find a multiplier without collisions and fill the slot table.
+ */
+static void msh_builtin_init(void)
+{
+   unsigned mult;
+   int i;
+
+   for (mult = 2654435761u;; mult += 2) {
+      memset(msh_builtin_slot, 0, sizeof(msh_builtin_slot));
+      for (i = 0; i < msh_num_builtins(); i++) {
+         unsigned slot = msh_builtin_hash(msh_strhash(msh_builtins[i].name), mult);
+         if (msh_builtin_slot[slot]) {
+            break;
+         }
+         msh_builtin_slot[slot] = i + 1;
+      }
+      if (i == msh_num_builtins()) {
+         msh_builtin_mult = mult;
+         return;
+      }
+   }
+}
+
+/**
+   @brief Look up a builtin by name.
+   @param name The command name.
+   @return The builtin, or NULL if name is not a builtin.
+ */
+const struct msh_builtin* msh_find_builtin(const char* name)
+{
+   const struct msh_builtin* b;
+   unsigned char idx;
+
+   if (!msh_builtin_mult) {
+      msh_builtin_init();
+   }
+   idx = msh_builtin_slot[msh_builtin_hash(msh_strhash(name), msh_builtin_mult)];
+   if (idx == 0) {
+      return NULL;
+   }
+   b = &msh_builtins[idx - 1];
+   return strcmp(b->name, name) == 0 ? b : NULL;
+}
+
+/*
+  Command location cache.  Names are resolved against $PATH once and
+  then exec'd directly by absolute path.  The table is dropped when PATH
+  is set or unset, and an entry is dropped when exec'ing it fails.
+ */
+#define MSH_HASH_SIZE 256 // buckets, power of two
+#define MSH_DEFAULT_PATH "/bin:/usr/bin"
+
+struct msh_hash_entry {
+   struct msh_hash_entry* next;
+   char* name;
+   char* path;
+   unsigned hits;
+};
+
+static struct msh_hash_entry* msh_hash_table[MSH_HASH_SIZE];
+static char* msh_hash_pathvar;   // PATH the table is filled from, NULL once it changes
+
+/**
+   @brief Forget every remembered command location.
+ */
+void msh_hash_clear(void)
+{
+   struct msh_hash_entry* e;
+   struct msh_hash_entry* next;
+   int i;
+
+   for (i = 0; i < MSH_HASH_SIZE; i++) {
+      for (e = msh_hash_table[i]; e; e = next) {
+         next = e->next;
+         free(e->name);
+         free(e->path);
+         free(e);
+      }
+      msh_hash_table[i] = NULL;
+   }
+}
+
+/**
+   @brief Note that PATH was set or unset: the table is dropped before
+   the next lookup.
+ */
+void msh_hash_path_changed(void)
+{
+   free(msh_hash_pathvar);
+   msh_hash_pathvar = NULL;
+}
+
+/**
+   @brief Forget the remembered location of one command.
+   @param name The command name.
+ */
+void msh_hash_forget(const char* name)
+{
+   struct msh_hash_entry** ep = &msh_hash_table[msh_strhash(name) & (MSH_HASH_SIZE - 1)];
+   struct msh_hash_entry* e;
+
+   for (; (e = *ep); ep = &e->next) {
+      if (strcmp(e->name, name) == 0) {
+         *ep = e->next;
+         free(e->name);
+         free(e->path);
+         free(e);
+         return;
+      }
+   }
+}
+
+/**
+   @brief Search $PATH for an executable.
+   @param name The command name, without any '/'.
+   @param path The PATH value to search.
+   @return Newly allocated absolute path, or NULL if not found.
+ */
+static char* msh_path_search(const char* name, const char* path)
+{
+   size_t namelen = strlen(name);
+   const char* dir = path;
+   struct stat st;
+
+   while (1) {
+      const char* end = strchr(dir, ':');
+      size_t dirlen = end ? (size_t)(end - dir) : strlen(dir);
+      char* full = malloc(dirlen + namelen + 3);
+
+      if (!full) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      if (dirlen == 0) {
+         strcpy(full, ".");   // empty entry means the current directory
+         dirlen = 1;
+      }
+      else {
+         memcpy(full, dir, dirlen);
+      }
+      full[dirlen] = '/';
+      memcpy(full + dirlen + 1, name, namelen + 1);
+
+      if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0) {
+         return full;
+      }
+      free(full);
+      if (!end) {
+         return NULL;
+      }
+      dir = end + 1;
+   }
+}
+
+/**
+   @brief Resolve a command name to the path to exec.
+   @param name The command name.  Names containing '/' are used as is.
+   @return The path, or NULL (with errno set to ENOENT) if not found.
+ */
+const char* msh_hash_lookup(const char* name)
+{
+   const char* pathvar;
+   struct msh_hash_entry* e;
+   unsigned b;
+   char* full;
+
+   if (strchr(name, '/')) {
+      return name;
+   }
+
+   if (!msh_hash_pathvar) {
+      pathvar = msh_var_get("PATH");
+      msh_hash_clear();
+      msh_hash_pathvar = strdup(pathvar ? pathvar : MSH_DEFAULT_PATH);
+      if (!msh_hash_pathvar) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   pathvar = msh_hash_pathvar;
+
+   b = msh_strhash(name) & (MSH_HASH_SIZE - 1);
+   for (e = msh_hash_table[b]; e; e = e->next) {
+      if (strcmp(e->name, name) == 0) {
+         e->hits++;
+         return e->path;
+      }
+   }
+
+   full = msh_path_search(name, pathvar);
+   if (!full) {
+      errno = ENOENT;
+      return NULL;
+   }
+   e = malloc(sizeof(struct msh_hash_entry));
+   if (!e || !(e->name = strdup(name))) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   e->path = full;
+   e->hits = 1;
+   e->next = msh_hash_table[b];
+   msh_hash_table[b] = e;
+   return full;
+}
+
+/*
+  Output buffer.  Builtins write their standard output here instead of
+  through stdio; it goes out with one writev when the command finishes,
+  and before the shell starts any process, so nothing is written twice
+  by a forked child and builtin output stays in order with the output of
+  programs.  Short strings are copied into the buffer; long ones that
+  outlive the command are referenced in place.
+ */
+#define MSH_OUT_BUFSIZE 8192
+#define MSH_OUT_IOVS    64
+#define MSH_OUT_REF     256   // referenced rather than copied from this long
+
+struct msh_obuf {
+   int fd;
+   int niov;
+   int error;        // a write failed since the last flush
+   size_t used;      // bytes of buf in use
+   struct iovec iov[MSH_OUT_IOVS];
+   char buf[MSH_OUT_BUFSIZE];
+};
+
+struct msh_obuf msh_out = { STDOUT_FILENO };
+
+/**
+   @brief Write out everything buffered, with as few writev calls as the
+   system allows.  Whatever could not be written is dropped.
+   @param o The buffer.
+   @return 0, or -1 if any write failed since the last flush.
+ */
+int msh_obuf_flush(struct msh_obuf* o)
+{
+   struct iovec* iov = o->iov;
+   int n = o->niov;
+   int ret;
+   ssize_t w;
+
+   while (n > 0) {
+      w = writev(o->fd, iov, n > IOV_MAX ? IOV_MAX : n);
+      if (w < 0 && errno == EINTR) {
+         continue;
+      }
+      if (w < 0) {
+         o->error = 1;
+         break;
+      }
+      for (; n > 0 && (size_t)w >= iov->iov_len; iov++, n--) {
+         w -= iov->iov_len;
+      }
+      if (n > 0) {
+         iov->iov_base = (char*)iov->iov_base + w;
+         iov->iov_len -= w;
+      }
+   }
+   ret = o->error ? -1 : 0;
+   o->niov = 0;
+   o->used = 0;
+   o->error = 0;
+   return ret;
+}
+
+/**
+   @brief Queue bytes, joining them to the previous piece when adjacent.
+   @param o The buffer.
+   @param s The bytes, which must stay valid until the next flush.
+   @param n How many.
+ */
+static void msh_obuf_add(struct msh_obuf* o, const char* s, size_t n)
+{
+   struct iovec* last = o->niov > 0 ? &o->iov[o->niov - 1] : NULL;
+
+   if (last && (char*)last->iov_base + last->iov_len == s) {
+      last->iov_len += n;
+      return;
+   }
+   if (o->niov == MSH_OUT_IOVS) {
+      if (msh_obuf_flush(o) < 0) {
+         o->error = 1;
+      }
+   }
+   o->iov[o->niov].iov_base = (char*)s;
+   o->iov[o->niov++].iov_len = n;
+}
+
+/**
+   @brief Copy bytes into the buffer.
+   @param o The buffer.
+   @param s The bytes.
+   @param n How many.
+ */
+void msh_obuf_write(struct msh_obuf* o, const char* s, size_t n)
+{
+   // Flush before copying, not in msh_obuf_add: a flush there would
+   // empty buf under the piece just copied into it.
+   if ((n > MSH_OUT_BUFSIZE - o->used || o->niov == MSH_OUT_IOVS) &&
+       msh_obuf_flush(o) < 0) {
+      o->error = 1;
+   }
+   if (n > MSH_OUT_BUFSIZE) {
+      // too big to copy: send it now, in order
+      msh_obuf_add(o, s, n);
+      if (msh_obuf_flush(o) < 0) {
+         o->error = 1;
+      }
+      return;
+   }
+   memcpy(o->buf + o->used, s, n);
+   msh_obuf_add(o, o->buf + o->used, n);
+   o->used += n;
+}
+
+/**
+   @brief Queue a string without copying it, if it is long enough for
+   that to pay.
+   @param o The buffer.
+   @param s The string, which must stay valid until the next flush.
+   @param n Its length.
+ */
+void msh_obuf_ref(struct msh_obuf* o, const char* s, size_t n)
+{
+   if (n < MSH_OUT_REF) {
+      msh_obuf_write(o, s, n);
+   }
+   else {
+      msh_obuf_add(o, s, n);
+   }
+}
+
+/**
+   @brief Queue one character.
+   @param o The buffer.
+   @param c The character.
+ */
+void msh_obuf_putc(struct msh_obuf* o, int c)
+{
+   char ch = c;
+
+   msh_obuf_write(o, &ch, 1);
+}
+
+/**
+   @brief Format into the buffer, like printf.
+   @param o The buffer.
+   @param fmt The format.
+ */
+void msh_obuf_printf(struct msh_obuf* o, const char* fmt, ...)
+{
+   va_list ap;
+   char* big;
+   int n;
+
+   if (o->niov == MSH_OUT_IOVS && msh_obuf_flush(o) < 0) {
+      o->error = 1;   // as in msh_obuf_write
+   }
+   va_start(ap, fmt);
+   n = vsnprintf(o->buf + o->used, MSH_OUT_BUFSIZE - o->used, fmt, ap);
+   va_end(ap);
+   if (n < 0) {
+      return;
+   }
+   if ((size_t)n < MSH_OUT_BUFSIZE - o->used) {
+      msh_obuf_add(o, o->buf + o->used, n);
+      o->used += n;
+      return;
+   }
+
+   // Did not fit: format again, into a fresh buffer or on the heap.
+   if ((size_t)n < MSH_OUT_BUFSIZE && msh_obuf_flush(o) < 0) {
+      o->error = 1;
+   }
+   big = (size_t)n < MSH_OUT_BUFSIZE ? o->buf : malloc(n + 1);
+   if (!big) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   va_start(ap, fmt);
+   vsnprintf(big, n + 1, fmt, ap);
+   va_end(ap);
+   msh_obuf_write(o, big, n);
+   if (big != o->buf) {
+      free(big);
+   }
+}
+
+/*
+  Working directory.  The shell keeps its logical path (the one cd was
+  given, with symlinks left in) in msh_cwd, so pwd and everything else
+  that wants the directory read a string instead of calling getcwd.  It
+  changes only in msh_chdir, which also exports PWD and OLDPWD; getcwd
+  is left for pwd -P and for putting the cache right when the logical
+  path cannot be used.
+ */
+static char* msh_cwd;      // logical working directory, NULL until first use
+static char* msh_oldpwd;   // previous one, NULL if there has been none
+
+static char** msh_dirstack;   // pushd stack, top last
+static int msh_ndirs, msh_dirs_cap;
+
+/**
+   @brief getcwd into a buffer that grows until the path fits.
+   @return The physical working directory, malloc'd; NULL with errno set
+   if it cannot be found.
+ */
+char* msh_getcwd_alloc(void)
+{
+   size_t size = 256;
+   char* buf = NULL;
+
+   for (;;) {
+      char* nbuf = realloc(buf, size);
+
+      if (!nbuf) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      buf = nbuf;
+      if (getcwd(buf, size)) {
+         return buf;
+      }
+      if (errno != ERANGE) {
+         free(buf);
+         return NULL;
+      }
+      size *= 2;
+   }
+}
+
+/**
+   @brief Duplicate a string, exiting on allocation failure.
+   @param str The string.
+   @return The copy.
+ */
+static char* msh_xstrdup(const char* str)
+{
+   char* dup = strdup(str);
+
+   if (!dup) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   return dup;
+}
+
+/**
+   @brief Remove ".", ".." and repeated slashes from an absolute path,
+   in place, without looking at the filesystem.
+   @param path The path.
+ */
+static void msh_path_clean(char* path)
+{
+   char* in = path;
+   char* out = path;
+
+   while (*in) {
+      char* end;
+      size_t len;
+
+      while (*in == '/') {
+         in++;
+      }
+      for (end = in; *end && *end != '/'; end++)
+         ;
+      len = end - in;
+      if (len == 0 || (len == 1 && in[0] == '.')) {
+         // nothing to keep
+      }
+      else if (len == 2 && in[0] == '.' && in[1] == '.') {
+         while (out > path && *--out != '/')
+            ;
+      }
+      else {
+         *out++ = '/';
+         memmove(out, in, len);
+         out += len;
+      }
+      in = end;
+   }
+   if (out == path) {
+      *out++ = '/';
+   }
+   *out = '\0';
+}
+
+/**
+   @brief The logical working directory.
+   @return The cached path.  On first use it is $PWD when that names the
+   current directory, else what getcwd says.
+ */
+const char* msh_cwd_get(void)
+{
+   const char* env;
+   struct stat a, b;
+
+   if (msh_cwd) {
+      return msh_cwd;
+   }
+   env = msh_var_get("PWD");
+   if (env && env[0] == '/' && stat(env, &a) == 0 && stat(".", &b) == 0 &&
+       a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+      msh_cwd = msh_xstrdup(env);
+      msh_path_clean(msh_cwd);
+   }
+   else {
+      msh_cwd = msh_getcwd_alloc();
+      if (!msh_cwd) {
+         msh_cwd = msh_xstrdup(".");   // removed under us; still usable for chdir
+      }
+   }
+   msh_var_set("PWD", msh_cwd, MSH_VAR_EXPORT);
+   env = msh_var_get("OLDPWD");
+   if (env && !msh_oldpwd) {
+      msh_oldpwd = msh_xstrdup(env);
+   }
+   return msh_cwd;
+}
+
+/**
+   @brief Change directory and update the cache, PWD and OLDPWD.
+   @param dir The directory, absolute or relative to the logical one.
+   @return 0 on success, -1 with errno set on failure.
+ */
+int msh_chdir(const char* dir)
+{
+   const char* cwd = msh_cwd_get();
+   size_t clen = strlen(cwd), dlen = strlen(dir);
+   char* path = malloc(clen + dlen + 2);
+   int physical = 0;
+
+   if (!path) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   if (dir[0] == '/' || cwd[0] != '/') {
+      memcpy(path, dir, dlen + 1);
+   }
+   else {
+      memcpy(path, cwd, clen);
+      path[clen] = '/';
+      memcpy(path + clen + 1, dir, dlen + 1);
+   }
+   if (path[0] == '/') {
+      msh_path_clean(path);
+   }
+   if (chdir(path) != 0) {
+      // Too long for one chdir, or ".." through a symlink that no longer
+      // resolves: go the physical way and ask where we ended up.
+      if (chdir(dir) != 0) {
+         free(path);
+         return -1;
+      }
+      physical = 1;
+   }
+   if (physical || path[0] != '/') {
+      char* phys = msh_getcwd_alloc();
+
+      if (phys) {
+         free(path);
+         path = phys;
+      }
+   }
+   free(msh_oldpwd);
+   msh_oldpwd = msh_cwd;
+   msh_cwd = path;
+   msh_var_set("OLDPWD", msh_oldpwd, MSH_VAR_EXPORT);
+   msh_var_set("PWD", msh_cwd, MSH_VAR_EXPORT);
+   return 0;
+}
+
+/*
+  Builtin function implementations.
+*/
+
+int msh_builtin_status;   // exit status of the last builtin
+
+/**
+   @brief Built-in command: prints the current working directory
+   @param args list of args. args[0] is "pwd".  With -P the physical
+   directory is printed, symlinks resolved.
+   @return Always returns 1, to continue executing.
+*/
+int msh_pwd(char** args)
+{
+   char* cwd;
+
+   if (args[1] == NULL || strcmp(args[1], "-L") == 0) {
+      msh_obuf_printf(&msh_out, "Current working dir: %s\n", msh_cwd_get());
+   }
+   else if (strcmp(args[1], "-P") == 0) {
+      cwd = msh_getcwd_alloc();
+      if (cwd) {
+         msh_obuf_printf(&msh_out, "Current working dir: %s\n", cwd);
+         free(cwd);
+      }
+      else {
+         perror("cwd error");
+         msh_builtin_status = 1;
+      }
+   }
+   else {
+      fprintf(stderr, "msh: pwd: %s: unknown option\n", args[1]);
+      msh_builtin_status = 2;
+   }
+   return 1;
+}
+
+/**
+   @brief Built-in command: change directory.
+   @param args List of args.  args[0] is "cd".  args[1] is the directory;
+   "-" is the previous one, and $HOME is used when it is missing.
+   @return Always returns 1, to continue executing.
+ */
+int msh_cd(char** args)
+{
+   const char* dir = args[1];
+   int back = 0;
+
+   if (dir == NULL) {
+      dir = msh_var_get("HOME");
+      if (dir == NULL) {
+         fprintf(stderr, "msh: expected argument to \"cd\"\n");
+         msh_builtin_status = 1;
+         return 1;
+      }
+   }
+   else if (strcmp(dir, "-") == 0) {
+      msh_cwd_get();
+      if (msh_oldpwd == NULL) {
+         fprintf(stderr, "msh: cd: OLDPWD not set\n");
+         msh_builtin_status = 1;
+         return 1;
+      }
+      dir = msh_oldpwd;
+      back = 1;
+   }
+   if (msh_chdir(dir) != 0) {
+      perror("msh");
+      msh_builtin_status = 1;
+   }
+   else if (back) {
+      msh_obuf_printf(&msh_out, "%s\n", msh_cwd);
+   }
+   return 1;
+}
+
+/**
+   @brief Print the directory stack, the current directory first.
+ */
+static void msh_dirs_print(void)
+{
+   int i;
+
+   msh_obuf_printf(&msh_out, "%s", msh_cwd_get());
+   for (i = msh_ndirs - 1; i >= 0; i--) {
+      msh_obuf_printf(&msh_out, " %s", msh_dirstack[i]);
+   }
+   msh_obuf_putc(&msh_out, '\n');
+}
+
+/**
+   @brief Built-in command: change directory, remembering the old one.
+   @param args List of args.  args[0] is "pushd".  args[1] is the new
+   directory; without it the current directory and the top of the stack
+   trade places.
+   @return Always returns 1, to continue executing.
+ */
+int msh_pushd(char** args)
+{
+   const char* dir = args[1];
+   char* here;
+
+   if (dir == NULL) {
+      if (msh_ndirs == 0) {
+         fprintf(stderr, "msh: pushd: no other directory\n");
+         msh_builtin_status = 1;
+         return 1;
+      }
+      dir = msh_dirstack[msh_ndirs - 1];
+   }
+   here = msh_xstrdup(msh_cwd_get());
+   if (msh_chdir(dir) != 0) {
+      fprintf(stderr, "msh: pushd: %s: %s\n", dir, strerror(errno));
+      free(here);
+      msh_builtin_status = 1;
+      return 1;
+   }
+   if (args[1] == NULL) {
+      free(msh_dirstack[msh_ndirs - 1]);
+      msh_dirstack[msh_ndirs - 1] = here;
+   }
+   else {
+      if (msh_ndirs == msh_dirs_cap) {
+         int cap = msh_dirs_cap ? msh_dirs_cap * 2 : 8;
+         char** stack = realloc(msh_dirstack, cap * sizeof(char*));
+
+         if (!stack) {
+            fprintf(stderr, "msh: allocation error\n");
+            exit(EXIT_FAILURE);
+         }
+         msh_dirstack = stack;
+         msh_dirs_cap = cap;
+      }
+      msh_dirstack[msh_ndirs++] = here;
+   }
+   msh_dirs_print();
+   return 1;
+}
+
+/**
+   @brief Built-in command: return to the directory on top of the stack.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int msh_popd(char** args)
+{
+   char* dir;
+
+   if (msh_ndirs == 0) {
+      fprintf(stderr, "msh: popd: directory stack empty\n");
+      msh_builtin_status = 1;
+      return 1;
+   }
+   dir = msh_dirstack[msh_ndirs - 1];
+   if (msh_chdir(dir) != 0) {
+      fprintf(stderr, "msh: popd: %s: %s\n", dir, strerror(errno));
+      msh_builtin_status = 1;
+      return 1;
+   }
+   free(dir);
+   msh_ndirs--;
+   msh_dirs_print();
+   return 1;
+}
+
+/**
+   @brief Built-in command: show the directory stack.
+   @param args List of args.  args[0] is "dirs".  With -c the stack is
+   emptied instead.
+   @return Always returns 1, to continue executing.
+ */
+int msh_dirs(char** args)
+{
+   if (args[1] != NULL && strcmp(args[1], "-c") == 0) {
+      while (msh_ndirs > 0) {
+         free(msh_dirstack[--msh_ndirs]);
+      }
+      return 1;
+   }
+   msh_dirs_print();
+   return 1;
+}
+
+/**
+   @brief Builtin command: print help.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int msh_help(char** args)
+{
+   int i;
+   msh_obuf_printf(&msh_out, "Group 11's MSH\n");
+   msh_obuf_printf(&msh_out, "Type program names and arguments, and hit enter.\n");
+   msh_obuf_printf(&msh_out, "The following are built in:\n");
+
+   for (i = 0; i < msh_num_builtins(); i++) {
+      msh_obuf_printf(&msh_out, "  %s\n", msh_builtins[i].name);
+   }
+
+   msh_obuf_printf(&msh_out, "Use the man command for information on other programs.\n");
+   return 1;
+}
+
+/**
+   @brief Builtin command: show or change remembered command locations.
+   @param args List of args.  args[0] is "hash".  "-r" forgets all,
+   "-d name" forgets one, any other names are looked up and remembered.
+   @return Always returns 1, to continue executing.
+ */
+int msh_hash(char** args)
+{
+   struct msh_hash_entry* e;
+   int i, any = 0;
+
+   if (args[1] == NULL) {
+      for (i = 0; i < MSH_HASH_SIZE; i++) {
+         for (e = msh_hash_table[i]; e; e = e->next) {
+            if (!any) {
+               msh_obuf_printf(&msh_out, "hits\tcommand\n");
+               any = 1;
+            }
+            msh_obuf_printf(&msh_out, "%4u\t%s\n", e->hits, e->path);
+         }
+      }
+      if (!any) {
+         msh_obuf_printf(&msh_out, "hash: hash table empty\n");
+      }
+      return 1;
+   }
+
+   for (i = 1; args[i] != NULL; i++) {
+      if (strcmp(args[i], "-r") == 0) {
+         msh_hash_clear();
+      }
+      else if (strcmp(args[i], "-d") == 0 && args[i + 1] != NULL) {
+         msh_hash_forget(args[++i]);
+      }
+      else if (msh_hash_lookup(args[i]) == NULL) {
+         fprintf(stderr, "msh: hash: %s: not found\n", args[i]);
+         msh_builtin_status = 1;
+      }
+   }
+   return 1;
+}
+
+/*
+  What running a pipeline came to.  msh_execute fills one in; msh_last
+  is the one for the pipeline run last, which $? and PIPESTATUS show
+  and which gives the shell its own exit status.
+ */
+struct msh_result {
+   int status;          // as $? shows it: the exit code, or 128 plus a signal
+   int signal;          // the signal that killed or stopped the job, else 0
+   int nstages;         // entries in pipestatus
+   int* pipestatus;     // each stage's status, as status is
+   int cap;             // room in pipestatus
+   struct rusage ru;    // of the stages together; a lone builtin's only when timed
+   double real;         // wall-clock seconds
+};
+
+struct msh_result msh_last;    // of the last pipeline run
+
+/**
+   @brief Builtin command: exit.
+   @param args List of args.  args[0] is "exit".  args[1] is the status
+   to exit with; without it, that of the last command.
+   @return Always returns 0, to terminate execution.
+ */
+int msh_exit(char** args)
+{
+   char* end;
+   long n;
+
+   msh_builtin_status = msh_last.status;
+   if (args[1] == NULL) {
+      return 0;
+   }
+   n = strtol(args[1], &end, 10);
+   if (*args[1] == '\0' || *end != '\0') {
+      fprintf(stderr, "msh: exit: %s: numeric argument required\n", args[1]);
+      msh_builtin_status = 2;
+   }
+   else {
+      msh_builtin_status = n & 0xff;
+   }
+   return 0;
+}
+
+/*
+  Utilities that scripts call often enough that starting a process for
+  each call dominates their cost.  They report their exit status in
+  msh_builtin_status.
+ */
+
+/**
+   @brief Builtin command: do nothing, successfully.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int msh_true(char** args)
+{
+   msh_builtin_status = 0;
+   return 1;
+}
+
+/**
+   @brief Builtin command: do nothing, unsuccessfully.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int msh_false(char** args)
+{
+   msh_builtin_status = 1;
+   return 1;
+}
+
+/**
+   @brief Write one character of a backslash escape, as echo -e and
+   printf understand them.
+   @param s Points just past the backslash; advanced past the escape.
+   @param octal_zero Nonzero if octal escapes are written \0nnn, as in
+   echo and printf %b, rather than \nnn, as in printf formats.
+   @return 0, or -1 for \c, which ends all output.
+ */
+static int msh_put_escape(const char** s, int octal_zero)
+{
+   static const char from[] = "abefnrtv\\";
+   static const char to[] = "\a\b\033\f\n\r\t\v\\";
+   const char* p = *s;
+   const char* k;
+   int c, n;
+
+   if (*p == 'c') {
+      *s = p + 1;
+      return -1;
+   }
+   if (*p != '\0' && (k = strchr(from, *p)) != NULL) {
+      msh_obuf_putc(&msh_out, to[k - from]);
+      *s = p + 1;
+      return 0;
+   }
+   if ((octal_zero && *p == '0') || (!octal_zero && *p >= '0' && *p <= '7')) {
+      p += octal_zero;
+      for (c = 0, n = 0; n < 3 && *p >= '0' && *p <= '7'; n++, p++) {
+         c = c * 8 + (*p - '0');
+      }
+      msh_obuf_putc(&msh_out, c);
+      *s = p;
+      return 0;
+   }
+   msh_obuf_putc(&msh_out, '\\');   // not an escape: keep the backslash
+   return 0;
+}
+
+/**
+   @brief Builtin command: write the arguments.
+   @param args List of args.  args[0] is "echo".  Leading -n (no
+   newline), -e (interpret backslash escapes) and -E (do not) options
+   are recognized, as are combinations such as -ne.
+   @return Always returns 1, to continue executing.
+ */
+int msh_echo(char** args)
+{
+   const char* s;
+   int i, newline = 1, escapes = 0;
+
+   for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+      if (strspn(args[i] + 1, "neE") != strlen(args[i] + 1)) {
+         break;   // not an option: echo it
+      }
+      for (s = args[i] + 1; *s; s++) {
+         if (*s == 'n') {
+            newline = 0;
+         }
+         else {
+            escapes = *s == 'e';
+         }
+      }
+   }
+
+   for (; args[i] != NULL; i++) {
+      if (!escapes) {
+         msh_obuf_ref(&msh_out, args[i], strlen(args[i]));
+      }
+      else {
+         for (s = args[i]; *s; ) {
+            if (*s != '\\') {
+               msh_obuf_putc(&msh_out, *s++);
+            }
+            else if (s++, msh_put_escape(&s, 1) < 0) {
+               goto out;   // \c: nothing more, not even the newline
+            }
+         }
+      }
+      if (args[i + 1] != NULL) {
+         msh_obuf_putc(&msh_out, ' ');
+      }
+   }
+   if (newline) {
+      msh_obuf_putc(&msh_out, '\n');
+   }
+out:
+   msh_builtin_status = msh_obuf_flush(&msh_out) == 0 ? 0 : 1;
+   return 1;
+}
+
+/**
+   @brief Convert a printf argument to a number, as printf(1) does: a
+   leading quote gives the value of the next character.
+   @param arg The argument, or NULL when the arguments have run out.
+   @param ok Cleared if arg is not a number.
+   @return The number.
+ */
+static long long msh_printf_num(const char* arg, int* ok)
+{
+   char* end;
+   long long n;
+
+   if (arg == NULL) {
+      return 0;
+   }
+   if (arg[0] == '\'' || arg[0] == '"') {
+      return (unsigned char)arg[1];
+   }
+   errno = 0;
+   n = strtoll(arg, &end, 0);
+   if (end == arg || *end != '\0' || errno) {
+      fprintf(stderr, "msh: printf: %s: invalid number\n", arg);
+      *ok = 0;
+   }
+   return n;
+}
+
+/**
+   @brief Convert a printf argument to a floating-point number, as
+   msh_printf_num does to an integer.
+   @param arg The argument, or NULL when the arguments have run out.
+   @param ok Cleared if arg is not a number.
+   @return The number.
+ */
+static double msh_printf_float(const char* arg, int* ok)
+{
+   char* end;
+   double d;
+
+   if (arg == NULL) {
+      return 0;
+   }
+   if (arg[0] == '\'' || arg[0] == '"') {
+      return (unsigned char)arg[1];
+   }
+   errno = 0;
+   d = strtod(arg, &end);
+   if (end == arg || *end != '\0' || errno == ERANGE) {
+      fprintf(stderr, "msh: printf: %s: invalid number\n", arg);
+      *ok = 0;
+   }
+   return d;
+}
+
+/**
+   @brief Builtin command: write arguments under the control of a
+   format, like printf(1).  The format is reused while arguments remain.
+   @param args List of args.  args[0] is "printf", args[1] the format.
+   Conversions d i o u x X f F e E g G a A c s b and %% are supported,
+   with flags, width and precision.
+   @return Always returns 1, to continue executing.
+ */
+int msh_printf(char** args)
+{
+   char spec[64];
+   const char* f;
+   const char* arg;
+   char** next;
+   size_t n;
+   int ok = 1, stop = 0, used;
+
+   if (args[1] == NULL) {
+      fprintf(stderr, "msh: printf: usage: printf format [arguments]\n");
+      msh_builtin_status = 2;
+      return 1;
+   }
+
+   next = &args[2];
+   do {
+      used = 0;
+      for (f = args[1]; *f && !stop; ) {
+         if (*f == '\\') {
+            f++;
+            stop = msh_put_escape(&f, 0) < 0;
+            continue;
+         }
+         if (*f != '%') {
+            msh_obuf_putc(&msh_out, *f++);
+            continue;
+         }
+         if (f[1] == '%') {
+            msh_obuf_putc(&msh_out, '%');
+            f += 2;
+            continue;
+         }
+
+         n = 1 + strspn(f + 1, "-+ #0");
+         n += strspn(f + n, "0123456789");
+         if (f[n] == '.') {
+            n += 1 + strspn(f + n + 1, "0123456789");
+         }
+         if (f[n] == '\0' || n + 4 > sizeof(spec) || !strchr("diouxXfFeEgGaAcsb", f[n])) {
+            fprintf(stderr, "msh: printf: %.*s: invalid format\n", (int)n + 1, f);
+            msh_builtin_status = 1;
+            msh_obuf_flush(&msh_out);
+            return 1;
+         }
+         memcpy(spec, f, n);
+         arg = *next;
+         if (arg) {
+            next++;
+            used = 1;
+         }
+
+         switch (f[n]) {
+         case 'd': case 'i':
+            memcpy(spec + n, "lld", 4);
+            msh_obuf_printf(&msh_out, spec, msh_printf_num(arg, &ok));
+            break;
+         case 'o': case 'u': case 'x': case 'X':
+            spec[n] = spec[n + 1] = 'l';
+            spec[n + 2] = f[n];
+            spec[n + 3] = '\0';
+            msh_obuf_printf(&msh_out, spec, (unsigned long long)msh_printf_num(arg, &ok));
+            break;
+         case 'f': case 'F': case 'e': case 'E':
+         case 'g': case 'G': case 'a': case 'A':
+            spec[n] = f[n];
+            spec[n + 1] = '\0';
+            msh_obuf_printf(&msh_out, spec, msh_printf_float(arg, &ok));
+            break;
+         case 'c':
+            memcpy(spec + n, "c", 2);
+            msh_obuf_printf(&msh_out, spec, arg && *arg ? *arg : '\0');
+            break;
+         case 's':
+            memcpy(spec + n, "s", 2);
+            msh_obuf_printf(&msh_out, spec, arg ? arg : "");
+            break;
+         case 'b':
+            for (arg = arg ? arg : ""; *arg && !stop; ) {
+               if (*arg != '\\') {
+                  msh_obuf_putc(&msh_out, *arg++);
+               }
+               else {
+                  arg++;
+                  stop = msh_put_escape(&arg, 1) < 0;
+               }
+            }
+            break;
+         }
+         f += n + 1;
+      }
+   } while (used && *next != NULL && !stop);
+
+   msh_builtin_status = msh_obuf_flush(&msh_out) == 0 && ok ? 0 : 1;
+   return 1;
+}
+
+/*
+  test and [.  A recursive descent evaluator over the arguments:
+     expr    := and ( -o and )*
+     and     := not ( -a not )*
+     not     := ! not | primary
+     primary := ( expr ) | arg binop arg | unop arg | arg
+  A binary operator is tried first, so [ -n = -n ] compares strings.
+ */
+struct msh_test_state {
+   char** args;
+   int pos;
+   int n;
+   int error;
+};
+
+static int msh_test_expr(struct msh_test_state* ts);
+
+/**
+   @brief Whether a string is a binary test operator.
+ */
+static int msh_test_binop(const char* op)
+{
+   static const char* ops[] = {
+      "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", NULL
+   };
+   int i;
+
+   for (i = 0; ops[i]; i++) {
+      if (strcmp(op, ops[i]) == 0) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/**
+   @brief Convert a test operand to an integer.
+   @param ts The evaluator, whose error flag is set on failure.
+   @param arg The operand.
+ */
+static long long msh_test_int(struct msh_test_state* ts, const char* arg)
+{
+   char* end;
+   long long n;
+
+   errno = 0;
+   n = strtoll(arg, &end, 10);
+   while (*end == ' ' || *end == '\t') {
+      end++;
+   }
+   if (end == arg || *end != '\0' || errno) {
+      fprintf(stderr, "msh: test: %s: integer expression expected\n", arg);
+      ts->error = 1;
+   }
+   return n;
+}
+
+/**
+   @brief Compare the modification times of two files, for -nt and -ot.
+   A file that does not exist is older than any that does.
+   @return Negative, zero or positive as a is older, as old, or newer.
+ */
+static int msh_test_mtime_cmp(const char* a, const char* b)
+{
+   struct stat sa, sb;
+   int ha = stat(a, &sa) == 0;
+   int hb = stat(b, &sb) == 0;
+
+   if (!ha || !hb) {
+      return ha - hb;
+   }
+   if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec) {
+      return sa.st_mtim.tv_sec < sb.st_mtim.tv_sec ? -1 : 1;
+   }
+   return sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec ? -1 :
+          sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec;
+}
+
+/**
+   @brief Evaluate a binary test.
+ */
+static int msh_test_binary(struct msh_test_state* ts, const char* a, const char* op,
+                           const char* b)
+{
+   long long x, y;
+
+   if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+      return strcmp(a, b) == 0;
+   }
+   if (strcmp(op, "!=") == 0) {
+      return strcmp(a, b) != 0;
+   }
+   if (strcmp(op, "-nt") == 0) {
+      return msh_test_mtime_cmp(a, b) > 0;
+   }
+   if (strcmp(op, "-ot") == 0) {
+      return msh_test_mtime_cmp(a, b) < 0;
+   }
+
+   x = msh_test_int(ts, a);
+   y = msh_test_int(ts, b);
+   switch (op[1] << 8 | op[2]) {
+   case 'e' << 8 | 'q': return x == y;
+   case 'n' << 8 | 'e': return x != y;
+   case 'l' << 8 | 't': return x < y;
+   case 'l' << 8 | 'e': return x <= y;
+   case 'g' << 8 | 't': return x > y;
+   }
+   return x >= y;   // -ge
+}
+
+/**
+   @brief Evaluate a unary test.
+   @return The result, or -1 if op is not a unary operator.
+ */
+static int msh_test_unary(const char* op, const char* arg)
+{
+   struct stat st;
+
+   if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+      return -1;
+   }
+   switch (op[1]) {
+   case 'n': return arg[0] != '\0';
+   case 'z': return arg[0] == '\0';
+   case 't': return isatty(atoi(arg));
+   case 'r': return access(arg, R_OK) == 0;
+   case 'w': return access(arg, W_OK) == 0;
+   case 'x': return access(arg, X_OK) == 0;
+   case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+   }
+   if (!strchr("efdsbcpS", op[1])) {
+      return -1;
+   }
+   if (stat(arg, &st) != 0) {
+      return 0;
+   }
+   switch (op[1]) {
+   case 'f': return S_ISREG(st.st_mode);
+   case 'd': return S_ISDIR(st.st_mode);
+   case 's': return st.st_size > 0;
+   case 'b': return S_ISBLK(st.st_mode);
+   case 'c': return S_ISCHR(st.st_mode);
+   case 'p': return S_ISFIFO(st.st_mode);
+   case 'S': return S_ISSOCK(st.st_mode);
+   }
+   return 1;   // -e
+}
+
+/**
+   @brief primary := ( expr ) | arg binop arg | unop arg | arg
+ */
+static int msh_test_primary(struct msh_test_state* ts)
+{
+   char** a = &ts->args[ts->pos];
+   int left = ts->n - ts->pos;
+   int r;
+
+   if (left <= 0) {
+      fprintf(stderr, "msh: test: argument expected\n");
+      ts->error = 1;
+      return 0;
+   }
+   if (left >= 3 && msh_test_binop(a[1])) {
+      ts->pos += 3;
+      return msh_test_binary(ts, a[0], a[1], a[2]);
+   }
+   if (left >= 2 && (r = msh_test_unary(a[0], a[1])) >= 0) {
+      ts->pos += 2;
+      return r;
+   }
+   if (strcmp(a[0], "(") == 0 && left >= 2) {
+      ts->pos++;
+      r = msh_test_expr(ts);
+      if (ts->pos >= ts->n || strcmp(ts->args[ts->pos], ")") != 0) {
+         fprintf(stderr, "msh: test: `)' expected\n");
+         ts->error = 1;
+         return 0;
+      }
+      ts->pos++;
+      return r;
+   }
+   ts->pos++;
+   return a[0][0] != '\0';
+}
+
+/**
+   @brief not := ! not | primary
+ */
+static int msh_test_not(struct msh_test_state* ts)
+{
+   if (ts->pos < ts->n - 1 && strcmp(ts->args[ts->pos], "!") == 0) {
+      ts->pos++;
+      return !msh_test_not(ts);
+   }
+   return msh_test_primary(ts);
+}
+
+/**
+   @brief and := not ( -a not )*
+ */
+static int msh_test_and(struct msh_test_state* ts)
+{
+   int r = msh_test_not(ts);
+
+   while (ts->pos < ts->n && !ts->error && strcmp(ts->args[ts->pos], "-a") == 0) {
+      ts->pos++;
+      r = msh_test_not(ts) && r;
+   }
+   return r;
+}
+
+/**
+   @brief expr := and ( -o and )*
+ */
+static int msh_test_expr(struct msh_test_state* ts)
+{
+   int r = msh_test_and(ts);
+
+   while (ts->pos < ts->n && !ts->error && strcmp(ts->args[ts->pos], "-o") == 0) {
+      ts->pos++;
+      r = msh_test_and(ts) || r;
+   }
+   return r;
+}
+
+/**
+   @brief Builtin command: evaluate a conditional expression, as test or
+   [ ... ].
+   @param args List of args.  args[0] is "test" or "[".
+   @return Always returns 1, to continue executing.
+ */
+int msh_test(char** args)
+{
+   struct msh_test_state ts = { args + 1, 0, 0, 0 };
+   int r;
+
+   while (ts.args[ts.n] != NULL) {
+      ts.n++;
+   }
+   if (strcmp(args[0], "[") == 0) {
+      if (ts.n == 0 || strcmp(ts.args[ts.n - 1], "]") != 0) {
+         fprintf(stderr, "msh: [: missing `]'\n");
+         msh_builtin_status = 2;
+         return 1;
+      }
+      ts.n--;
+   }
+   if (ts.n == 0) {
+      msh_builtin_status = 1;   // no expression is false
+      return 1;
+   }
+
+   r = msh_test_expr(&ts);
+   if (!ts.error && ts.pos < ts.n) {
+      fprintf(stderr, "msh: test: %s: unexpected argument\n", ts.args[ts.pos]);
+      ts.error = 1;
+   }
+   msh_builtin_status = ts.error ? 2 : !r;
+   return 1;
+}
+
+/*
+  Per-command arena.  Everything the read/split/execute cycle allocates
+  for one line (the line itself, tokens, argv vectors, pipeline data)
+  comes from here and is released at once by msh_arena_reset.
+ */
+#define MSH_ARENA_BLOCKSIZE 16384
+
+struct msh_arena_block {
+   struct msh_arena_block* next;
+   size_t size;
+   size_t used;
+   char data[];
+};
+
+struct msh_arena {
+   struct msh_arena_block* head;   // block currently being filled
+};
+
+/**
+   @brief Allocate memory that lives until the arena is reset.
+   @param a The arena.
+   @param n Number of bytes.
+   @return Pointer to n bytes, aligned for any type.
+ */
+void* msh_arena_alloc(struct msh_arena* a, size_t n)
+{
+   struct msh_arena_block* b = a->head;
+   void* p;
+
+   n = (n + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+   if (!b || b->size - b->used < n) {
+      size_t size = MSH_ARENA_BLOCKSIZE;
+      while (size < n) {
+         size *= 2;
+      }
+      b = malloc(sizeof(struct msh_arena_block) + size);
+      if (!b) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      b->next = a->head;
+      b->size = size;
+      b->used = 0;
+      a->head = b;
+   }
+   p = b->data + b->used;
+   b->used += n;
+   return p;
+}
+
+/**
+   @brief Copy n bytes into the arena and NUL-terminate them.
+   @param a The arena.
+   @param src Bytes to copy.
+   @param n Number of bytes.
+   @return The copy.
+ */
+char* msh_arena_strndup(struct msh_arena* a, const char* src, size_t n)
+{
+   char* p = msh_arena_alloc(a, n + 1);
+   memcpy(p, src, n);
+   p[n] = '\0';
+   return p;
+}
+
+/**
+   @brief Release everything allocated from the arena.  If the last cycle
+   needed more than one block, they are merged into one block big enough
+   for all of it, so steady state runs out of a single block.
+   @param a The arena.
+ */
+void msh_arena_reset(struct msh_arena* a)
+{
+   struct msh_arena_block* b = a->head;
+   struct msh_arena_block* next;
+   size_t total = 0;
+
+   if (!b) {
+      return;
+   }
+   if (!b->next) {
+      b->used = 0;
+      return;
+   }
+   for (; b; b = next) {
+      next = b->next;
+      total += b->size;
+      free(b);
+   }
+   a->head = NULL;
+   msh_arena_alloc(a, total);
+   a->head->used = 0;
+}
+
+/*
+  Parsed commands.  A line is parsed into a list of pipelines; each
+  pipeline is a list of simple commands.  Words point into the line
+  buffer, so none of this owns any text.
+ */
+#define MSH_REDIR_IN     0   // [n]< path
+#define MSH_REDIR_OUT    1   // [n]> path
+#define MSH_REDIR_APPEND 2   // [n]>> path
+#define MSH_REDIR_DUP    3   // [n]>&m, [n]<&m
+
+struct msh_redir {
+   int type;         // MSH_REDIR_*
+   int fd;           // descriptor being redirected
+   char* path;       // file, or the m of a dup
+   int src;          // descriptor to dup2 onto fd; set when applied
+};
+
+struct msh_cmd {
+   char** argv;      // null terminated
+   struct msh_redir* redirs;
+   int nredirs;
+   char** assigns;   // NAME=value words before the command name
+   int nassigns;
+   int expand;       // a word or path holds a reference, expanded at run time
+   const struct msh_attrs* attrs;   // from a with prefix, or NULL
+   char** with;      // that prefix's words, while they are still to expand
+};
+
+/*
+  The lexer leaves this byte in a word where a $ starts a reference, so
+  that quoted and escaped dollars, which it writes as plain $, stay
+  literal.
+ */
+#define MSH_EXP_MARK '\001'
+
+struct msh_pipeline {
+   struct msh_cmd* cmds;
+   int ncmds;
+   int background;   // followed by "&"
+   int timed;        // prefixed with "time"
+   int pipebuf;      // prefixed with "pipebuf=SIZE", else 0
+   char* text;       // source text, for job messages
+   int cond;         // MSH_COND_*: whether the next pipeline runs
+   char* fname;      // name() { fbody }: defines a function, has no cmds
+   char* fbody;
+   struct msh_attrs* attrs;   // prefixed with "with ... --", else NULL
+   char** with;      // instead, its words when they hold references
+};
+
+#define MSH_COND_ALWAYS 0   // after ; & or at the end of the line
+#define MSH_COND_AND    1   // after &&: if this one's status is 0
+#define MSH_COND_OR     2   // after ||: if it is not
+
+/*
+  Shell options, changed with the set builtin.
+ */
+int msh_pipebuf;   // capacity for pipeline pipes, 0 for the kernel's
+
+/**
+   @brief Parse a size such as 65536, 256k, 1M or 2G.
+   @param str The size.
+   @param max The largest size accepted.
+   @return The size in bytes, or -1 if str is not a size up to max.
+ */
+long long msh_parse_bytes(const char* str, long long max)
+{
+   char* end;
+   long long n, mult = 1;
+
+   errno = 0;
+   n = strtoll(str, &end, 10);
+   if (end == str || errno || n < 0) {
+      return -1;
+   }
+   switch (*end) {
+   case 'k': case 'K': mult = 1LL << 10; end++; break;
+   case 'm': case 'M': mult = 1LL << 20; end++; break;
+   case 'g': case 'G': mult = 1LL << 30; end++; break;
+   case 't': case 'T': mult = 1LL << 40; end++; break;
+   }
+   if (*end != '\0' || n > max / mult) {
+      return -1;
+   }
+   return n * mult;
+}
+
+/**
+   @brief Parse a size that fits in an int, such as a pipe capacity.
+   @param str The size.
+   @return The size in bytes, or -1 if str is not a size that fits.
+ */
+long msh_parse_size(const char* str)
+{
+   return msh_parse_bytes(str, 0x7fffffffL);
+}
+
+/*
+  Process creation backends.  posix_spawn is the default: on Linux it is
+  built on vfork-style clone, so its cost does not grow with the size of
+  the shell.  Plain fork is kept for the cases that need to run code in
+  the child before exec, and a fork server for launching from a process
+  that is smaller than the shell.
+ */
+#define MSH_SPAWN_POSIX  0
+#define MSH_SPAWN_VFORK  1
+#define MSH_SPAWN_FORK   2
+#define MSH_SPAWN_SERVER 3
+
+static const char* msh_spawn_names[] = { "posix_spawn", "vfork", "fork", "server" };
+
+#if defined(MSH_USE_FORK)
+int msh_spawn_backend = MSH_SPAWN_FORK;
+#elif defined(MSH_USE_VFORK)
+int msh_spawn_backend = MSH_SPAWN_VFORK;
+#elif defined(MSH_USE_FORKSERVER)
+int msh_spawn_backend = MSH_SPAWN_SERVER;
+#else
+int msh_spawn_backend = MSH_SPAWN_POSIX;
+#endif
+
+#define MSH_EXEC_FAILED 127   // exit status of a child whose exec failed
+
+extern char** environ;
+
+/*
+  Launch attributes, given by a "with ATTR=VALUE... --" prefix and set in
+  each child of the pipeline between fork and exec.  posix_spawn has no
+  attributes for any of them, so such a command is started with vfork
+  instead.  A builtin run in the shell passes them on to the jobs it
+  starts, through msh_with; parallel pins each of its job slots to one
+  CPU of the set.
+ */
+#define MSH_ATTR_CPUS  1   // cpus=0-3,8: CPU affinity
+#define MSH_ATTR_NICE  2   // nice=N: niceness
+#define MSH_ATTR_MEM   4   // mem=SIZE: address space limit
+#define MSH_ATTR_FILES 8   // files=N: open file limit
+#define MSH_ATTR_BAD   16  // malformed once expanded: every stage fails
+
+#define MSH_ATTR_FAILED 126   // exit status of a child that could not set them
+
+struct msh_attrs {
+   int set;          // MSH_ATTR_* given
+   cpu_set_t cpus;
+   int nice;
+   rlim_t mem;
+   rlim_t files;
+};
+
+const struct msh_attrs* msh_with;   // of the builtin running, for the jobs it starts
+
+/**
+   @brief Report an error in a child before exec, with one writev(2):
+   stdio and strerror are not safe in a vfork child.
+   @param what What failed, such as "with: " or "", then a name.
+   @param name The attribute or program.
+   @param err The errno value.
+   @param other The reason to give for an errno not listed here.
+ */
+static void msh_child_error(const char* what, const char* name, int err,
+                            const char* other)
+{
+   const char* why = err == EPERM ? "Operation not permitted" :
+                     err == EACCES ? "Permission denied" :
+                     err == EINVAL ? "Invalid argument" :
+                     err == ENOENT ? "No such file or directory" :
+                     err == ENOTDIR ? "Not a directory" :
+                     err == ENOEXEC ? "Exec format error" :
+                     err == E2BIG ? "Argument list too long" :
+                     err == ENOMEM ? "Cannot allocate memory" :
+                     err == ETXTBSY ? "Text file busy" : other;
+   const char* parts[] = { "msh: ", what, name, ": ", why, "\n" };
+   struct iovec iov[sizeof(parts) / sizeof(parts[0])];
+   size_t i;
+
+   for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+      iov[i].iov_base = (char*)parts[i];
+      iov[i].iov_len = strlen(parts[i]);
+   }
+   if (writev(STDERR_FILENO, iov, i) < 0) {
+      // nothing more can be done
+   }
+}
+
+/**
+   @brief Report an attribute that could not be set.  Async-signal safe.
+   @param what The attribute.
+   @param err The errno value.
+ */
+static void msh_attrs_error(const char* what, int err)
+{
+   msh_child_error("with: ", what, err, "cannot be set");
+}
+
+/**
+   @brief Set launch attributes on the calling process.  Async-signal
+   safe, for a child before exec.
+   @param a The attributes.
+   @return 0, or -1 (after printing an error) if one cannot be set.
+ */
+static int msh_attrs_apply(const struct msh_attrs* a)
+{
+   struct rlimit rl;
+
+   if (a->set & MSH_ATTR_BAD) {
+      return -1;   // msh_expand_cmds said why
+   }
+
+   if ((a->set & MSH_ATTR_CPUS) && sched_setaffinity(0, sizeof(a->cpus), &a->cpus) < 0) {
+      msh_attrs_error("cpus", errno);
+      return -1;
+   }
+   if (a->set & MSH_ATTR_MEM) {
+      rl.rlim_cur = rl.rlim_max = a->mem;
+      if (setrlimit(RLIMIT_AS, &rl) < 0) {
+         msh_attrs_error("mem", errno);
+         return -1;
+      }
+   }
+   if (a->set & MSH_ATTR_FILES) {
+      rl.rlim_cur = rl.rlim_max = a->files;
+      if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+         msh_attrs_error("files", errno);
+         return -1;
+      }
+   }
+   if ((a->set & MSH_ATTR_NICE) && setpriority(PRIO_PROCESS, 0, a->nice) < 0) {
+      msh_attrs_error("nice", errno);
+      return -1;
+   }
+   return 0;
+}
+
+/**
+   @brief Parse a CPU list such as 0-3,8,10-11.
+   @param str The list.
+   @param cpus Receives the CPUs.
+   @return 0, or -1 if str is not a list of CPUs that exist in a cpu_set_t.
+ */
+static int msh_parse_cpus(const char* str, cpu_set_t* cpus)
+{
+   const char* p = str;
+   char* end;
+   long lo, hi;
+
+   CPU_ZERO(cpus);
+   do {
+      if (!isdigit((unsigned char)*p)) {
+         return -1;
+      }
+      lo = hi = strtol(p, &end, 10);
+      if (*end == '-') {
+         p = end + 1;
+         if (!isdigit((unsigned char)*p)) {
+            return -1;
+         }
+         hi = strtol(p, &end, 10);
+      }
+      if (lo > hi || hi >= CPU_SETSIZE) {
+         return -1;
+      }
+      for (; lo <= hi; lo++) {
+         CPU_SET(lo, cpus);
+      }
+      p = end + (*end == ',');
+   } while (*end == ',');
+   return *end == '\0' ? 0 : -1;
+}
+
+/**
+   @brief Parse the ATTR=VALUE words of a with prefix.
+   @param words The words, NULL-terminated.
+   @param a Receives the attributes.
+   @return 0, or -1 (after printing an error) if one is malformed.
+ */
+static int msh_attrs_parse(char** words, struct msh_attrs* a)
+{
+   long long n;
+   char* value;
+   char* end;
+
+   memset(a, 0, sizeof(struct msh_attrs));
+   for (; *words; words++) {
+      value = strchr(*words, '=');
+      value = value ? value + 1 : "";
+      if (strncmp(*words, "cpus=", 5) == 0 && msh_parse_cpus(value, &a->cpus) == 0) {
+         a->set |= MSH_ATTR_CPUS;
+      }
+      else if (strncmp(*words, "nice=", 5) == 0 &&
+               (errno = 0, n = strtol(value, &end, 10), *value && !*end && !errno &&
+                n >= -20 && n <= 19)) {
+         a->nice = n;
+         a->set |= MSH_ATTR_NICE;
+      }
+      else if (strncmp(*words, "mem=", 4) == 0 &&
+               (n = msh_parse_bytes(value, LLONG_MAX)) > 0) {
+         a->mem = n;
+         a->set |= MSH_ATTR_MEM;
+      }
+      else if (strncmp(*words, "files=", 6) == 0 &&
+               (n = msh_parse_bytes(value, INT_MAX)) > 0) {
+         a->files = n;
+         a->set |= MSH_ATTR_FILES;
+      }
+      else {
+         msh_error_prefix();
+         fprintf(stderr, "with: %s: bad attribute\n", *words);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/**
+   @brief Launch attributes in force for a command: its own, or those of
+   the builtin that is starting it.
+   @param cmd The command.
+   @return The attributes, or NULL for none.
+ */
+static inline const struct msh_attrs* msh_cmd_attrs(const struct msh_cmd* cmd)
+{
+   return cmd->attrs ? cmd->attrs : msh_with;
+}
+
+int msh_interactive;    // stdin is a terminal: do job control
+pid_t msh_shell_pgid;
+
+/*
+  Signals the interactive shell ignores or catches, and that children
+  get back at their default disposition.
+ */
+static const int msh_job_signals[] = {
+   SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD
+};
+#define MSH_NUM_JOB_SIGNALS (int)(sizeof(msh_job_signals) / sizeof(int))
+
+/**
+   @brief Lowest descriptor above every one a command redirects, and
+   above the low ones a shell uses.  What is kept there while the
+   redirections are wired cannot be overwritten by one of them.
+   @param cmd The command.
+   @return The descriptor number.
+ */
+static int msh_redir_base(const struct msh_cmd* cmd)
+{
+   int i, base = 10;
+
+   for (i = 0; i < cmd->nredirs; i++) {
+      if (cmd->redirs[i].fd >= base) {
+         base = cmd->redirs[i].fd + 1;
+      }
+   }
+   return base;
+}
+
+/**
+   @brief Open the files a command redirects to, close-on-exec, so that
+   errors are reported with the file name and a child only has to dup2.
+   Each file is moved above every target, or wiring 4>a 3>b in order
+   would put b on the 4 that a was opened at.  Dups need nothing opened.
+   @param cmd The command.
+   @return 0, or -1 (after printing an error) if a file cannot be opened.
+ */
+int msh_open_redirs(struct msh_cmd* cmd)
+{
+   static const int flags[] = {
+      O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND
+   };
+   struct msh_redir* r;
+   int base = msh_redir_base(cmd);
+   int i, fd;
+
+   for (i = 0; i < cmd->nredirs; i++) {
+      r = &cmd->redirs[i];
+      if (r->type == MSH_REDIR_DUP) {
+         r->src = atoi(r->path);
+         continue;
+      }
+      r->src = open(r->path, flags[r->type] | O_CLOEXEC, 0666);
+      if (r->src >= 0 && r->src < base) {
+         fd = fcntl(r->src, F_DUPFD_CLOEXEC, base);
+         close(r->src);
+         r->src = fd;
+      }
+      if (r->src < 0) {
+         fprintf(stderr, "msh: %s: %s\n", r->path, strerror(errno));
+         while (--i >= 0) {
+            if (cmd->redirs[i].type != MSH_REDIR_DUP) {
+               close(cmd->redirs[i].src);
+            }
+         }
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/**
+   @brief Close the files opened by msh_open_redirs.
+   @param cmd The command.
+ */
+void msh_close_redirs(struct msh_cmd* cmd)
+{
+   int i;
+
+   for (i = 0; i < cmd->nredirs; i++) {
+      if (cmd->redirs[i].type != MSH_REDIR_DUP) {
+         close(cmd->redirs[i].src);
+      }
+   }
+}
+
+/**
+   @brief Make fd a copy of src that survives exec.  Async-signal safe.
+   dup2 does nothing when the two are the same descriptor, as when open
+   returned the redirection target itself, so then only close-on-exec is
+   cleared.
+   @param src The descriptor to copy.
+   @param fd Where it goes.
+ */
+static void msh_dup_fd(int src, int fd)
+{
+   if (src == fd) {
+      fcntl(fd, F_SETFD, 0);
+   }
+   else {
+      dup2(src, fd);
+   }
+}
+
+/**
+   @brief Prepare a forked child: launch attributes, process group,
+   signals and stdio.  Pipe ends are wired first, then the command's
+   redirections in order.  Exits the child if an attribute cannot be set.
+   @param cmd The command, with its redirections opened.
+   @param fd_in Descriptor to use as stdin, or -1 to inherit.
+   @param fd_out Descriptor to use as stdout, or -1 to inherit.
+   @param pgid Process group to join, 0 for a new one, -1 to stay.
+ */
+static void msh_child_setup(struct msh_cmd* cmd, int fd_in, int fd_out, pid_t pgid)
+{
+   const struct msh_attrs* attrs = msh_cmd_attrs(cmd);
+   sigset_t none;
+   int i;
+
+   if (attrs && msh_attrs_apply(attrs) < 0) {
+      _exit(MSH_ATTR_FAILED);
+   }
+   if (pgid >= 0) {
+      setpgid(0, pgid);
+   }
+   for (i = 0; i < MSH_NUM_JOB_SIGNALS; i++) {
+      signal(msh_job_signals[i], SIG_DFL);
+   }
+   sigemptyset(&none);
+   sigprocmask(SIG_SETMASK, &none, NULL);
+   if (fd_in >= 0) {
+      msh_dup_fd(fd_in, STDIN_FILENO);
+   }
+   if (fd_out >= 0) {
+      msh_dup_fd(fd_out, STDOUT_FILENO);
+   }
+   for (i = 0; i < cmd->nredirs; i++) {
+      msh_dup_fd(cmd->redirs[i].src, cmd->redirs[i].fd);
+   }
+}
+
+/**
+   @brief Start a program through posix_spawn.
+   @param path Resolved path of the program.
+   @param cmd The command, with its redirections opened.
+   @param fd_in Descriptor to use as stdin, or -1 to inherit.
+   @param fd_out Descriptor to use as stdout, or -1 to inherit.
+   @param pgid Process group to join, 0 for a new one, -1 to stay.
+   @param pid Receives the child's pid.
+   @return 0, or an errno value on error.
+ */
+static int msh_spawn_posix(const char* path, struct msh_cmd* cmd, int fd_in,
+                           int fd_out, pid_t pgid, pid_t* pid)
+{
+   posix_spawn_file_actions_t actions;
+   posix_spawnattr_t attr;
+   sigset_t none, def;
+   short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+   int err, i;
+
+   posix_spawn_file_actions_init(&actions);
+   if (fd_in >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, fd_in, STDIN_FILENO);
+   }
+   if (fd_out >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, fd_out, STDOUT_FILENO);
+   }
+   for (i = 0; i < cmd->nredirs; i++) {
+      posix_spawn_file_actions_adddup2(&actions, cmd->redirs[i].src,
+                                       cmd->redirs[i].fd);
+   }
+
+   posix_spawnattr_init(&attr);
+   sigemptyset(&none);
+   sigemptyset(&def);
+   for (i = 0; i < MSH_NUM_JOB_SIGNALS; i++) {
+      sigaddset(&def, msh_job_signals[i]);
+   }
+   posix_spawnattr_setsigmask(&attr, &none);
+   posix_spawnattr_setsigdefault(&attr, &def);
+   if (pgid >= 0) {
+      flags |= POSIX_SPAWN_SETPGROUP;
+      posix_spawnattr_setpgroup(&attr, pgid);
+   }
+   posix_spawnattr_setflags(&attr, flags);
+
+   err = posix_spawn(pid, path, &actions, &attr, cmd->argv, environ);
+   posix_spawnattr_destroy(&attr);
+   posix_spawn_file_actions_destroy(&actions);
+   return err;
+}
+
+/**
+   @brief Start a program through fork or vfork and execv.
+   @param path Resolved path of the program.
+   @param cmd The command, with its redirections opened.
+   @param fd_in Descriptor to use as stdin, or -1 to inherit.
+   @param fd_out Descriptor to use as stdout, or -1 to inherit.
+   @param pgid Process group to join, 0 for a new one, -1 to stay.
+   @param use_vfork Nonzero to share the parent's address space until exec.
+   @return The child's pid, or -1 on error.
+ */
+static pid_t msh_spawn_fork(const char* path, struct msh_cmd* cmd, int fd_in,
+                            int fd_out, pid_t pgid, int use_vfork)
+{
+   pid_t pid;
+
+   pid = use_vfork ? vfork() : fork();
+   if (pid == 0) {
+      // Child process: only async-signal-safe calls until exec.
+      msh_child_setup(cmd, fd_in, fd_out, pgid);
+      execv(path, cmd->argv);
+      msh_child_error("", path, errno, "cannot execute");
+      _exit(MSH_EXEC_FAILED);
+   }
+   else if (pid < 0) {
+      // Error forking
+      perror("msh");
+   }
+   return pid;
+}
+
+/**
+   @brief Close every close-on-exec descriptor, as exec would.  A builtin
+   running in a forked child never execs, and would otherwise keep pipe
+   ends open that its readers wait on for end of file.
+ */
+static void msh_close_cloexec(void)
+{
+   DIR* dir = opendir("/proc/self/fd");
+   struct dirent* d;
+   int fd;
+
+   if (!dir) {
+      return;
+   }
+   while ((d = readdir(dir)) != NULL) {
+      fd = atoi(d->d_name);
+      if (fd > STDERR_FILENO && fd != dirfd(dir) &&
+          (fcntl(fd, F_GETFD) & FD_CLOEXEC)) {
+         close(fd);
+      }
+   }
+   closedir(dir);
+}
+
+/*
+  Fork server.  A child forked while the shell is still small, or a
+  fresh msh run as --fork-server when it starts later, takes
+  launch requests over a socket and starts each program with
+  clone(CLONE_PARENT), so the program is the shell's own child, reaped
+  by its SIGCHLD handler, yet is copied from the server's small address
+  space rather than the shell's.  A request carries the path, argv,
+  environment and working directory; stdin, stdout, stderr and the
+  opened redirections travel as descriptors (SCM_RIGHTS).  The server
+  keeps the last environment it was sent, and a request leaves it out
+  unless it has changed since.  If the server goes away, launches fall
+  back to posix_spawn.
+ */
+#define MSH_FS_MAXFDS 64
+#define MSH_FS_FDBASE 100   // where the child parks received descriptors
+#define MSH_FS_STACK  65536
+
+struct msh_fs_req {
+   pid_t pgid;
+   int nargs;     // argv strings, after the path
+   int nenv;      // environment strings, or -1 to reuse the last ones
+   int nfds;      // descriptors passed: stdin, stdout, stderr, then files
+   int nredirs;
+   struct msh_attrs attrs;   // set is 0 without any
+   size_t len;    // bytes of redirections and strings that follow
+};
+
+struct msh_fs_redir {
+   int fd;        // descriptor to set up in the child
+   int src;       // index of a passed descriptor, or a number to dup
+   int dup;       // nonzero for n>&m: src is a number
+};
+
+struct msh_fs_launch {   // one request, unpacked, for the child
+   struct msh_fs_req req;
+   struct msh_fs_redir* redirs;
+   int fds[MSH_FS_MAXFDS];
+   char* path;
+   char** argv;
+   char** envp;
+   char* cwd;
+};
+
+int msh_fs_sock = -1;   // the shell's end; -1 without a server
+int msh_fs_failed;      // the server died or could not start: stop trying
+static unsigned msh_fs_env_gen;   // msh_env_gen of what the server holds, 0 for none
+
+/**
+   @brief Read or write a whole buffer on a stream socket.
+   @param fd The socket.
+   @param buf The buffer.
+   @param len Its length.
+   @param out Nonzero to write.
+   @return 0, or -1 on an error or end of file.
+ */
+static int msh_fs_io(int fd, void* buf, size_t len, int out)
+{
+   char* p = buf;
+   ssize_t n;
+
+   while (len > 0) {
+      n = out ? send(fd, p, len, MSG_NOSIGNAL) : read(fd, p, len);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return -1;
+      }
+      p += n;
+      len -= n;
+   }
+   return 0;
+}
+
+/**
+   @brief Fork server child: set up a launched program and exec it.
+   Only async-signal-safe calls until exec.
+   @param arg The struct msh_fs_launch.
+ */
+static int msh_fs_child(void* arg)
+{
+   struct msh_fs_launch* l = arg;
+   int i;
+
+   if (l->req.attrs.set && msh_attrs_apply(&l->req.attrs) < 0) {
+      _exit(MSH_ATTR_FAILED);
+   }
+   if (l->req.pgid >= 0) {
+      setpgid(0, l->req.pgid);
+   }
+   for (i = 0; i < MSH_NUM_JOB_SIGNALS; i++) {
+      signal(msh_job_signals[i], SIG_DFL);
+   }
+   // Park the descriptors out of the way of any redirection target.
+   for (i = 0; i < l->req.nfds; i++) {
+      l->fds[i] = fcntl(l->fds[i], F_DUPFD_CLOEXEC, MSH_FS_FDBASE);
+   }
+   for (i = 0; i < 3; i++) {
+      dup2(l->fds[i], i);
+   }
+   for (i = 0; i < l->req.nredirs; i++) {
+      struct msh_fs_redir* r = &l->redirs[i];
+      msh_dup_fd(r->dup ? r->src : l->fds[r->src], r->fd);
+   }
+   if (l->cwd[0] != '\0' && chdir(l->cwd) < 0) {
+      perror("msh: cd");
+      _exit(MSH_EXEC_FAILED);
+   }
+   execve(l->path, l->argv, l->envp);
+   perror("msh");
+   _exit(MSH_EXEC_FAILED);
+}
+
+/**
+   @brief Fork server main loop.  Never returns; exits when the shell
+   closes its end.
+   @param sock The server's end of the socket.
+ */
+static void msh_fs_serve(int sock)
+{
+   static char stack[MSH_FS_STACK] __attribute__((aligned(16)));
+   char cbuf[CMSG_SPACE(sizeof(int) * MSH_FS_MAXFDS)];
+   struct msh_fs_launch l;
+   struct cmsghdr* cm;
+   struct msghdr msg;
+   struct iovec iov;
+   sigset_t none;
+   char* envbuf = NULL;   // the request the current environment came in
+   char** envp = NULL;
+   char* buf;
+   char* p;
+   ssize_t n;
+   pid_t pid;
+   int i, nfd;
+
+   for (i = 0; i < MSH_NUM_JOB_SIGNALS; i++) {
+      signal(msh_job_signals[i], msh_job_signals[i] == SIGCHLD ? SIG_DFL : SIG_IGN);
+   }
+   sigemptyset(&none);
+   sigprocmask(SIG_SETMASK, &none, NULL);
+
+   while (1) {
+      memset(&msg, 0, sizeof(msg));
+      iov.iov_base = &l.req;
+      iov.iov_len = sizeof(l.req);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = cbuf;
+      msg.msg_controllen = sizeof(cbuf);
+      n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0 || msh_fs_io(sock, (char*)&l.req + n, sizeof(l.req) - n, 0) < 0) {
+         _exit(EXIT_SUCCESS);
+      }
+
+      nfd = 0;
+      for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+         if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            nfd = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(l.fds, CMSG_DATA(cm), nfd * sizeof(int));
+         }
+      }
+      buf = malloc(l.req.len + 1);
+      l.argv = malloc((l.req.nargs + 1) * sizeof(char*));
+      l.envp = l.req.nenv >= 0 ? malloc((l.req.nenv + 1) * sizeof(char*)) : envp;
+      if (!buf || !l.argv || !l.envp) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      if (msh_fs_io(sock, buf, l.req.len, 0) < 0) {
+         _exit(EXIT_SUCCESS);
+      }
+
+      // redirections, then path, argv, environment and cwd
+      l.redirs = (struct msh_fs_redir*)buf;
+      p = buf + l.req.nredirs * sizeof(struct msh_fs_redir);
+      l.path = p;
+      p += strlen(p) + 1;
+      for (i = 0; i < l.req.nargs; i++, p += strlen(p) + 1) {
+         l.argv[i] = p;
+      }
+      l.argv[i] = NULL;
+      if (l.req.nenv >= 0) {
+         for (i = 0; i < l.req.nenv; i++, p += strlen(p) + 1) {
+            l.envp[i] = p;
+         }
+         l.envp[i] = NULL;
+         free(envbuf);
+         free(envp);
+         envbuf = buf;   // kept for the requests that reuse it
+         envp = l.envp;
+      }
+      l.cwd = p;
+
+      if (nfd != l.req.nfds) {
+         pid = -EBADF;
+      }
+      else {
+         pid = clone(msh_fs_child, stack + sizeof(stack), CLONE_PARENT | SIGCHLD, &l);
+         if (pid < 0) {
+            pid = -errno;
+         }
+      }
+      if (msh_fs_io(sock, &pid, sizeof(pid), 1) < 0) {
+         _exit(EXIT_SUCCESS);
+      }
+      for (i = 0; i < nfd; i++) {
+         close(l.fds[i]);
+      }
+      if (buf != envbuf) {
+         free(buf);
+      }
+      free(l.argv);
+   }
+}
+
+/**
+   @brief Start the fork server.  Best done early, while the shell is
+   still small: started later, it would copy all that the shell has
+   grown, so it is run afresh instead.
+   @param reexec Nonzero to exec msh as the server, rather than serve
+   from a fork of the shell as it is now.
+   @return 0, or -1 (after printing an error) if it could not start.
+ */
+int msh_fs_start(int reexec)
+{
+   char fd[16];
+   int sv[2];
+   pid_t pid;
+
+   if (msh_fs_sock >= 0) {
+      return 0;
+   }
+   if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+      perror("msh: fork server");
+      msh_fs_failed = 1;
+      return -1;
+   }
+   pid = fork();
+   if (pid == 0) {
+      close(sv[0]);
+      fcntl(sv[1], F_SETFD, 0);
+      if (reexec) {
+         snprintf(fd, sizeof(fd), "%d", sv[1]);
+         execl("/proc/self/exe", "msh", "--fork-server", fd, (char*)NULL);
+         // no fresh image to be had: serve from this one after all
+      }
+      msh_close_cloexec();
+      fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+      msh_fs_serve(sv[1]);
+   }
+   close(sv[1]);
+   if (pid < 0) {
+      perror("msh: fork server");
+      close(sv[0]);
+      msh_fs_failed = 1;
+      return -1;
+   }
+   msh_fs_sock = sv[0];
+   msh_fs_failed = 0;
+   msh_fs_env_gen = 0;
+   return 0;
+}
+
+/**
+   @brief Stop using the fork server.  Closing the socket makes it exit.
+ */
+void msh_fs_stop(void)
+{
+   if (msh_fs_sock >= 0) {
+      close(msh_fs_sock);
+      msh_fs_sock = -1;
+   }
+}
+
+/**
+   @brief Start a program through the fork server.
+   @param path Resolved path of the program.
+   @param cmd The command, with its redirections opened.
+   @param fd_in Descriptor to use as stdin, or -1 to inherit.
+   @param fd_out Descriptor to use as stdout, or -1 to inherit.
+   @param pgid Process group to join, 0 for a new one, -1 to stay.
+   @param pid Receives the child's pid.
+   @return 0, an errno value if the program could not be started, or -1
+   if the server is unusable, which stops the server.
+ */
+static int msh_spawn_server(const char* path, struct msh_cmd* cmd, int fd_in,
+                            int fd_out, pid_t pgid, pid_t* pid)
+{
+   char cbuf[CMSG_SPACE(sizeof(int) * MSH_FS_MAXFDS)];
+   int fds[MSH_FS_MAXFDS];
+   const char* cwd = msh_cwd_get();
+   struct msh_fs_req req;
+   struct msh_fs_redir* r;
+   struct cmsghdr* cm;
+   struct msghdr msg;
+   struct iovec iov;
+   char* buf;
+   char* p;
+   size_t len;
+   int i, ok;
+
+   if (cmd->nredirs > MSH_FS_MAXFDS - 3) {
+      return E2BIG;
+   }
+   req.pgid = pgid;
+   req.nredirs = cmd->nredirs;
+   if (msh_cmd_attrs(cmd)) {
+      req.attrs = *msh_cmd_attrs(cmd);
+   }
+   else {
+      req.attrs.set = 0;
+   }
+   fds[0] = fd_in >= 0 ? fd_in : STDIN_FILENO;
+   fds[1] = fd_out >= 0 ? fd_out : STDOUT_FILENO;
+   fds[2] = STDERR_FILENO;
+   req.nfds = 3;
+
+   len = cmd->nredirs * sizeof(struct msh_fs_redir) + strlen(path) + strlen(cwd) + 2;
+   for (req.nargs = 0; cmd->argv[req.nargs]; req.nargs++) {
+      len += strlen(cmd->argv[req.nargs]) + 1;
+   }
+   req.nenv = -1;
+   if (msh_fs_env_gen != msh_env_gen) {
+      for (req.nenv = 0; environ[req.nenv]; req.nenv++) {
+         len += strlen(environ[req.nenv]) + 1;
+      }
+   }
+   req.len = len;
+   buf = malloc(len);
+   if (!buf) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   r = (struct msh_fs_redir*)buf;
+   for (i = 0; i < cmd->nredirs; i++) {
+      r[i].fd = cmd->redirs[i].fd;
+      r[i].dup = cmd->redirs[i].type == MSH_REDIR_DUP;
+      if (r[i].dup) {
+         r[i].src = cmd->redirs[i].src;
+      }
+      else {
+         r[i].src = req.nfds;
+         fds[req.nfds++] = cmd->redirs[i].src;
+      }
+   }
+   p = buf + cmd->nredirs * sizeof(struct msh_fs_redir);
+   p = stpcpy(p, path) + 1;
+   for (i = 0; i < req.nargs; i++) {
+      p = stpcpy(p, cmd->argv[i]) + 1;
+   }
+   for (i = 0; i < req.nenv; i++) {
+      p = stpcpy(p, environ[i]) + 1;
+   }
+   strcpy(p, cwd);
+
+   memset(&msg, 0, sizeof(msg));
+   memset(cbuf, 0, sizeof(cbuf));
+   iov.iov_base = &req;
+   iov.iov_len = sizeof(req);
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf;
+   msg.msg_controllen = CMSG_SPACE(sizeof(int) * req.nfds);
+   cm = CMSG_FIRSTHDR(&msg);
+   cm->cmsg_level = SOL_SOCKET;
+   cm->cmsg_type = SCM_RIGHTS;
+   cm->cmsg_len = CMSG_LEN(sizeof(int) * req.nfds);
+   memcpy(CMSG_DATA(cm), fds, sizeof(int) * req.nfds);
+
+   while ((ok = sendmsg(msh_fs_sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+      ;
+   ok = ok == (int)sizeof(req) && msh_fs_io(msh_fs_sock, buf, len, 1) == 0 &&
+        msh_fs_io(msh_fs_sock, pid, sizeof(*pid), 0) == 0;
+   free(buf);
+   if (ok) {
+      msh_fs_env_gen = msh_env_gen;
+   }
+   if (!ok) {
+      fprintf(stderr, "msh: fork server gone, using posix_spawn\n");
+      msh_fs_stop();
+      msh_fs_failed = 1;
+      return -1;
+   }
+   return *pid < 0 ? -*pid : 0;
+}
+
+/**
+   @brief Builtin command: show or change shell options.
+   @param args List of args.  args[0] is "set".  Each further arg is an
+   option=value; without any, the options are listed.
+   @return Always returns 1, to continue executing.
+ */
+int msh_set(char** args)
+{
+   long n;
+   int i, k;
+
+   if (args[1] == NULL) {
+      msh_obuf_printf(&msh_out, "pipebuf=%d\n", msh_pipebuf);
+      msh_obuf_printf(&msh_out, "spawn=%s\n", msh_spawn_names[msh_spawn_backend]);
+      return 1;
+   }
+   for (i = 1; args[i] != NULL; i++) {
+      if (strncmp(args[i], "pipebuf=", 8) == 0) {
+         n = msh_parse_size(args[i] + 8);
+         if (n < 0) {
+            fprintf(stderr, "msh: set: %s: bad size\n", args[i] + 8);
+            msh_builtin_status = 1;
+         }
+         else {
+            msh_pipebuf = n;
+         }
+      }
+      else if (strncmp(args[i], "spawn=", 6) == 0) {
+         for (k = MSH_SPAWN_SERVER; k >= 0 && strcmp(args[i] + 6, msh_spawn_names[k]); k--)
+            ;
+         if (k < 0) {
+            fprintf(stderr, "msh: set: %s: unknown backend\n", args[i] + 6);
+            msh_builtin_status = 1;
+            continue;
+         }
+         msh_spawn_backend = k;
+         if (k == MSH_SPAWN_SERVER) {
+            msh_fs_failed = 0;   // try again, even after a failure
+            msh_fs_start(1);
+         }
+      }
+      else {
+         fprintf(stderr, "msh: set: %s: unknown option\n", args[i]);
+         msh_builtin_status = 1;
+      }
+   }
+   return 1;
+}
+
+/**
+   @brief Start a program using the selected backend.  Does not wait.
+   @param cmd The command, with its redirections opened.
+   @param fd_in Descriptor to use as stdin, or -1 to inherit.
+   @param fd_out Descriptor to use as stdout, or -1 to inherit.
+   @param pgid Process group to join, 0 for a new one, -1 to stay.
+   @return The child's pid, or -1 on error.
+ */
+pid_t msh_spawn(struct msh_cmd* cmd, int fd_in, int fd_out, pid_t pgid)
+{
+   char** args = cmd->argv;
+   const struct msh_attrs* attrs = msh_cmd_attrs(cmd);
+   const char* path;
+   pid_t pid;
+   int err, retry;
+
+   for (retry = 0; retry < 2; retry++) {
+      MSH_STAT_BEGIN(t_lookup);
+      path = msh_hash_lookup(args[0]);
+      MSH_STAT_END(MSH_ST_LOOKUP, t_lookup);
+      if (!path) {
+         perror("msh");
+         return -1;
+      }
+      if (msh_spawn_backend == MSH_SPAWN_FORK || msh_spawn_backend == MSH_SPAWN_VFORK ||
+          (attrs && msh_spawn_backend == MSH_SPAWN_POSIX)) {
+         return msh_spawn_fork(path, cmd, fd_in, fd_out, pgid,
+                               msh_spawn_backend != MSH_SPAWN_FORK);
+      }
+      err = -1;
+      if (msh_spawn_backend == MSH_SPAWN_SERVER && !msh_fs_failed &&
+          msh_fs_start(1) == 0) {
+         err = msh_spawn_server(path, cmd, fd_in, fd_out, pgid, &pid);
+      }
+      if (err < 0 && attrs) {
+         return msh_spawn_fork(path, cmd, fd_in, fd_out, pgid, 1);
+      }
+      if (err < 0) {
+         err = msh_spawn_posix(path, cmd, fd_in, fd_out, pgid, &pid);
+      }
+      if (err == 0) {
+         return pid;
+      }
+      // The remembered location may be stale: look it up once more.
+      msh_hash_forget(args[0]);
+   }
+   errno = err;
+   perror("msh");
+   return -1;
+}
+
+/**
+   @brief Note how a child exited.  A child that could not exec its
+   program exits with MSH_EXEC_FAILED, which drops the cached location.
+   @param name The program name the child was started with.
+   @param status The status from waitpid.
+ */
+void msh_reaped(const char* name, int status)
+{
+   if (WIFEXITED(status) && WEXITSTATUS(status) == MSH_EXEC_FAILED) {
+      msh_hash_forget(name);
+   }
+}
+
+void msh_input_discard(void);
+void msh_subshell_init(void);
+const struct msh_builtin* msh_find_command(const char* name);
+void msh_func_define(const char* name, const char* body);
+int msh_run_inline(const struct msh_builtin* b, struct msh_cmd* cmd, int fd_in,
+                   int fd_out);
+
+/**
+   @brief Start one pipeline stage.  Builtins run in a forked child so
+   that they can write into or read from the pipe like any program.
+   @param cmd The stage.
+   @param fd_in Descriptor to use as stdin, or -1 to inherit.
+   @param fd_out Descriptor to use as stdout, or -1 to inherit.
+   @param pgid Process group to join, 0 for a new one, -1 to stay.
+   @param status Receives the stage's exit status when no child is
+   started: 1 if a redirection or the fork failed, 0 for a stage of only
+   redirections, MSH_EXEC_FAILED if the program could not be started.
+   @return The child's pid, or -1 if none was started.
+ */
+static pid_t msh_spawn_stage(struct msh_cmd* cmd, int fd_in, int fd_out, pid_t pgid,
+                             int* status)
+{
+   char** args = cmd->argv;
+   const struct msh_builtin* b;
+   pid_t pid;
+   MSH_STAT_BEGIN(t_spawn);
+
+   *status = 1;
+   if (msh_open_redirs(cmd) < 0) {
+      return -1;
+   }
+   if (args[0] == NULL) {
+      // only redirections: the files have been created
+      msh_close_redirs(cmd);
+      *status = 0;
+      return -1;
+   }
+   b = msh_find_command(args[0]);
+   if (!b) {
+      pid = msh_spawn(cmd, fd_in, fd_out, pgid);
+      if (pid < 0) {
+         *status = MSH_EXEC_FAILED;
+      }
+      msh_close_redirs(cmd);
+      MSH_STAT_END(MSH_ST_SPAWN, t_spawn);
+      return pid;
+   }
+
+   msh_obuf_flush(&msh_out);   // or the child would write it again
+   pid = fork();
+   if (pid == 0) {
+      msh_child_setup(cmd, fd_in, fd_out, pgid);
+      msh_close_cloexec();
+      msh_subshell_init();
+      if (fd_in >= 0) {
+         msh_input_discard();   // read-ahead belongs to the shell's stdin
+      }
+      msh_builtin_status = 0;
+      (*b->func)(args);
+      msh_obuf_flush(&msh_out);
+      _exit(msh_builtin_status);
+   }
+   else if (pid < 0) {
+      perror("msh");
+   }
+   msh_close_redirs(cmd);
+   MSH_STAT_END(MSH_ST_SPAWN, t_spawn);
+   return pid;
+}
+
+/*
+  Job table.  Every child the shell starts belongs to a job, and while
+  it runs it is also in a registry hashed by pid.  Children are reaped
+  by the SIGCHLD handler alone, which finds each one in the registry and
+  records its status; the rest of the shell only looks at or changes the
+  table with SIGCHLD blocked, and waits with sigsuspend.
+ */
+#define MSH_PROC_RUNNING 0
+#define MSH_PROC_STOPPED 1
+#define MSH_PROC_DONE    2
+
+#define MSH_JOB_CTL    1   // own process group under job control
+#define MSH_JOB_INLINE 2   // may run a pure builtin stage in the shell
+
+struct msh_proc {
+   pid_t pid;
+   int status;      // as from waitpid
+   int state;       // MSH_PROC_*
+   char* name;      // argv[0]
+   struct rusage ru;         // from waitid, once done
+   struct timespec start;    // CLOCK_MONOTONIC, at spawn
+   struct timespec end;      // CLOCK_MONOTONIC, when reaped
+   struct msh_proc* hnext;   // registry chain
+};
+
+struct msh_job {
+   struct msh_job* next;
+   int id;          // the n in %n
+   pid_t pgid;      // 0 without job control
+   char* cmd;       // command text, for messages
+   int timed;       // report resource usage when freed
+   struct timespec start;
+   int nprocs;
+   struct msh_proc procs[];
+};
+
+struct msh_job* msh_jobs;   // most recent (the current job) first
+
+#define MSH_PROC_BUCKETS 512   // power of two
+
+static struct msh_proc* msh_proc_table[MSH_PROC_BUCKETS];
+
+/**
+   @brief Registry bucket for a pid.
+ */
+static inline struct msh_proc** msh_proc_bucket(pid_t pid)
+{
+   return &msh_proc_table[((unsigned)pid * 2654435761u >> 16) & (MSH_PROC_BUCKETS - 1)];
+}
+
+/**
+   @brief Add a started process to the registry.  Call with SIGCHLD
+   blocked.
+   @param p The process, with its pid set.
+ */
+static void msh_proc_register(struct msh_proc* p)
+{
+   struct msh_proc** b = msh_proc_bucket(p->pid);
+
+   p->hnext = *b;
+   *b = p;
+}
+
+/**
+   @brief Remove a process from the registry, if it is there.  Call with
+   SIGCHLD blocked, or from the handler.
+   @param p The process.
+ */
+static void msh_proc_unregister(struct msh_proc* p)
+{
+   struct msh_proc** pp;
+
+   for (pp = msh_proc_bucket(p->pid); *pp; pp = &(*pp)->hnext) {
+      if (*pp == p) {
+         *pp = p->hnext;
+         return;
+      }
+   }
+}
+
+/**
+   @brief Convert what waitid reports into a waitpid-style status.
+   @param info From waitid.
+   @return The status.
+ */
+static int msh_wait_status(const siginfo_t* info)
+{
+   switch (info->si_code) {
+   case CLD_EXITED:
+      return W_EXITCODE(info->si_status, 0);
+   case CLD_KILLED:
+      return W_EXITCODE(0, info->si_status);
+   case CLD_DUMPED:
+      return W_EXITCODE(0, info->si_status) | WCOREFLAG;
+   case CLD_STOPPED:
+   case CLD_TRAPPED:
+      return W_STOPCODE(info->si_status);
+   }
+   return 0xffff;   // CLD_CONTINUED, as WIFCONTINUED reads it
+}
+
+/**
+   @brief Record a status change reported by waitid.  A child that is
+   not registered is not ours to track, such as the fork server, and is
+   just reaped.
+   @param pid The child.
+   @param status Its status.
+   @param ru Its resource usage.
+ */
+static void msh_job_update(pid_t pid, int status, const struct rusage* ru)
+{
+   struct msh_proc* p;
+
+   for (p = *msh_proc_bucket(pid); p && p->pid != pid; p = p->hnext)
+      ;
+   if (!p) {
+      return;
+   }
+   if (WIFSTOPPED(status)) {
+      p->state = MSH_PROC_STOPPED;
+   }
+   else if (WIFCONTINUED(status)) {
+      p->state = MSH_PROC_RUNNING;
+   }
+   else {
+      p->status = status;
+      p->state = MSH_PROC_DONE;
+      p->ru = *ru;
+      clock_gettime(CLOCK_MONOTONIC, &p->end);
+      msh_proc_unregister(p);   // the pid may be reused from now on
+   }
+}
+
+/**
+   @brief SIGCHLD handler: reap every child that changed state.  The raw
+   waitid system call also reports the child's resource usage.
+   @param sig Not examined.
+ */
+static void msh_sigchld(int sig)
+{
+   int saved_errno = errno;
+   struct rusage ru;
+   siginfo_t info;
+
+   while (1) {
+      info.si_pid = 0;
+      if (syscall(SYS_waitid, P_ALL, 0, &info,
+                  WEXITED | WSTOPPED | WCONTINUED | WNOHANG, &ru) < 0 ||
+          info.si_pid == 0) {
+         break;
+      }
+      msh_job_update(info.si_pid, msh_wait_status(&info), &ru);
+   }
+   errno = saved_errno;
+}
+
+/**
+   @brief Block SIGCHLD, so the job table can be used safely.
+   @param old Receives the previous signal mask.
+ */
+void msh_block_sigchld(sigset_t* old)
+{
+   sigset_t chld;
+
+   sigemptyset(&chld);
+   sigaddset(&chld, SIGCHLD);
+   sigprocmask(SIG_BLOCK, &chld, old);
+}
+
+/**
+   @brief Summarize the state of a job's processes.
+   @param job The job.
+   @return MSH_PROC_RUNNING if any process runs, else MSH_PROC_STOPPED if
+   any is stopped, else MSH_PROC_DONE.
+ */
+int msh_job_state(struct msh_job* job)
+{
+   int k, state = MSH_PROC_DONE;
+
+   for (k = 0; k < job->nprocs; k++) {
+      if (job->procs[k].state == MSH_PROC_RUNNING) {
+         return MSH_PROC_RUNNING;
+      }
+      if (job->procs[k].state == MSH_PROC_STOPPED) {
+         state = MSH_PROC_STOPPED;
+      }
+   }
+   return state;
+}
+
+/**
+   @brief Exit status of one process the way the shell reports it: its
+   exit code, or 128 plus the signal that killed or stopped it.
+   @param p The process, done or stopped.
+   @return The status.
+ */
+static int msh_proc_code(const struct msh_proc* p)
+{
+   if (p->state == MSH_PROC_STOPPED) {
+      return 128 + WSTOPSIG(p->status);
+   }
+   if (WIFSIGNALED(p->status)) {
+      return 128 + WTERMSIG(p->status);
+   }
+   return WEXITSTATUS(p->status);
+}
+
+/**
+   @brief The stage whose status is a whole pipeline's: the first one
+   stopped, if any, else the last one.
+   @param procs The stages.
+   @param n Number of stages.
+ */
+static struct msh_proc* msh_status_proc(struct msh_proc* procs, int n)
+{
+   int k;
+
+   for (k = 0; k < n; k++) {
+      if (procs[k].state == MSH_PROC_STOPPED) {
+         return &procs[k];
+      }
+   }
+   return &procs[n - 1];
+}
+
+/**
+   @brief Exit status of a job the way the shell reports it: that of its
+   last stage, or 128 plus the signal that killed or stopped it.
+   @param job The job, done or stopped.
+   @return The status.
+ */
+int msh_job_status(struct msh_job* job)
+{
+   return msh_proc_code(msh_status_proc(job->procs, job->nprocs));
+}
+
+/**
+   @brief Seconds from one timestamp to another.
+ */
+static double msh_elapsed(const struct timespec* from, const struct timespec* to)
+{
+   return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+   @brief Print one line of a time report.
+   @param real Wall-clock seconds.
+   @param ru Resource usage.
+   @param label What the line is about.
+ */
+static void msh_time_line(double real, const struct rusage* ru, const char* label)
+{
+   fprintf(stderr, "%9.3f %9.3f %9.3f %9ld %7ld %7ld  %s\n", real,
+           ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+           ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+           ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, label);
+}
+
+/**
+   @brief Turn resource usage into the usage since an earlier sample.
+   maxrss is a peak and stays as it is.
+   @param ru The later sample; updated.
+   @param before The earlier sample.
+ */
+void msh_rusage_since(struct rusage* ru, const struct rusage* before)
+{
+   timersub(&ru->ru_utime, &before->ru_utime, &ru->ru_utime);
+   timersub(&ru->ru_stime, &before->ru_stime, &ru->ru_stime);
+   ru->ru_nvcsw -= before->ru_nvcsw;
+   ru->ru_nivcsw -= before->ru_nivcsw;
+}
+
+/**
+   @brief Add one process's resource usage to a total.  maxrss becomes
+   the larger of the two peaks.
+   @param total The total; updated.
+   @param ru The usage to add.
+ */
+static void msh_rusage_add(struct rusage* total, const struct rusage* ru)
+{
+   timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+   timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+   if (ru->ru_maxrss > total->ru_maxrss) {
+      total->ru_maxrss = ru->ru_maxrss;
+   }
+   total->ru_nvcsw += ru->ru_nvcsw;
+   total->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/**
+   @brief Report the resource usage of each process of a timed pipeline,
+   and a total line for pipelines of more than one stage.  Stages that
+   never started are left out; a stage that ran in the shell reports
+   the shell's own usage over it.
+   @param procs The processes.
+   @param n Number of processes.
+   @param start When the pipeline was started.
+ */
+void msh_time_report(struct msh_proc* procs, int n, const struct timespec* start)
+{
+   struct rusage total;
+   struct timespec last = *start;
+   int k, shown = 0;
+
+   memset(&total, 0, sizeof(total));
+   msh_obuf_flush(&msh_out);
+   fprintf(stderr, "%9s %9s %9s %9s %7s %7s  %s\n",
+           "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "stage");
+   for (k = 0; k < n; k++) {
+      if (procs[k].pid < 0) {
+         continue;
+      }
+      msh_time_line(msh_elapsed(&procs[k].start, &procs[k].end), &procs[k].ru,
+                    procs[k].name);
+      msh_rusage_add(&total, &procs[k].ru);
+      if (msh_elapsed(&last, &procs[k].end) > 0) {
+         last = procs[k].end;
+      }
+      shown++;
+   }
+   if (shown > 1) {
+      msh_time_line(msh_elapsed(start, &last), &total, "total");
+   }
+}
+
+/**
+   @brief Make room for a number of stages in a result.
+   @param res The result.
+   @param n Number of stages; becomes its nstages.
+ */
+static void msh_result_stages(struct msh_result* res, int n)
+{
+   if (n > res->cap) {
+      int* ps = realloc(res->pipestatus, n * sizeof(int));
+
+      if (!ps) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      res->pipestatus = ps;
+      res->cap = n;
+   }
+   res->nstages = n;
+}
+
+/**
+   @brief Record the result of a pipeline run from its processes, done or
+   stopped.  Stages that never started count with their failure status
+   and no resource usage.
+   @param res The result.
+   @param procs The stages.
+   @param n Number of stages.
+   @param start When the pipeline was started.
+ */
+void msh_result_fill(struct msh_result* res, struct msh_proc* procs, int n,
+                     const struct timespec* start)
+{
+   struct msh_proc* p = msh_status_proc(procs, n);
+   struct timespec now;
+   int k;
+
+   msh_result_stages(res, n);
+   memset(&res->ru, 0, sizeof(res->ru));
+   for (k = 0; k < n; k++) {
+      res->pipestatus[k] = msh_proc_code(&procs[k]);
+      if (procs[k].pid >= 0 && procs[k].state == MSH_PROC_DONE) {
+         msh_rusage_add(&res->ru, &procs[k].ru);
+      }
+   }
+   res->status = msh_proc_code(p);
+   res->signal = p->state == MSH_PROC_STOPPED ? WSTOPSIG(p->status) :
+                 WIFSIGNALED(p->status) ? WTERMSIG(p->status) : 0;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   res->real = msh_elapsed(start, &now);
+}
+
+/**
+   @brief Record a result that no process produced: a definition, or a
+   job left in the background.
+   @param res The result.
+   @param status Its status.
+ */
+void msh_result_set(struct msh_result* res, int status)
+{
+   msh_result_stages(res, 1);
+   res->pipestatus[0] = res->status = status;
+   res->signal = 0;
+   memset(&res->ru, 0, sizeof(res->ru));
+   res->real = 0;
+}
+
+/**
+   @brief Create a job and put it at the head of the table.  The job,
+   its processes and all of its strings are one allocation.  Call with
+   SIGCHLD blocked.
+   @param cmds The stages.
+   @param nstages Number of stages.
+   @param cmd Command text.
+   @return The job.
+ */
+static struct msh_job* msh_job_new(struct msh_cmd* cmds, int nstages, const char* cmd)
+{
+   struct msh_job* job;
+   struct msh_job* j;
+   size_t size = sizeof(struct msh_job) + nstages * sizeof(struct msh_proc);
+   size_t len;
+   char* str;
+   int k, id;
+
+   size += strlen(cmd) + 1;
+   for (k = 0; k < nstages; k++) {
+      size += strlen(cmds[k].argv[0] ? cmds[k].argv[0] : "") + 1;
+   }
+   job = malloc(size);
+   if (!job) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+
+   str = (char*)&job->procs[nstages];
+   len = strlen(cmd) + 1;
+   job->cmd = memcpy(str, cmd, len);
+   str += len;
+   for (k = 0; k < nstages; k++) {
+      len = strlen(cmds[k].argv[0] ? cmds[k].argv[0] : "") + 1;
+      job->procs[k].name = memcpy(str, cmds[k].argv[0] ? cmds[k].argv[0] : "", len);
+      job->procs[k].pid = -1;
+      job->procs[k].status = W_EXITCODE(1, 0);   // until it is started
+      job->procs[k].state = MSH_PROC_DONE;
+      str += len;
+   }
+   job->nprocs = nstages;
+   job->pgid = 0;
+   job->timed = 0;
+
+   // lowest free job number
+   for (id = 1;; id++) {
+      for (j = msh_jobs; j && j->id != id; j = j->next)
+         ;
+      if (!j) {
+         break;
+      }
+   }
+   job->id = id;
+   job->next = msh_jobs;
+   msh_jobs = job;
+   return job;
+}
+
+/**
+   @brief Remove a job from the table and free it.  Call with SIGCHLD
+   blocked.
+   @param job The job.
+ */
+static void msh_job_free(struct msh_job* job)
+{
+   struct msh_job** jp;
+   int k;
+
+   for (jp = &msh_jobs; *jp; jp = &(*jp)->next) {
+      if (*jp == job) {
+         *jp = job->next;
+         break;
+      }
+   }
+   for (k = 0; k < job->nprocs; k++) {
+      if (job->procs[k].pid > 0 && job->procs[k].state != MSH_PROC_DONE) {
+         msh_proc_unregister(&job->procs[k]);
+      }
+      else if (job->procs[k].pid > 0) {
+         msh_reaped(job->procs[k].name, job->procs[k].status);
+      }
+   }
+   if (job->timed) {
+      msh_time_report(job->procs, job->nprocs, &job->start);
+   }
+   free(job);
+}
+
+/*
+  Expansion.  References are expanded when a command runs, not when it
+  is parsed, since parsed lines are cached and a function body or alias
+  is parsed once for every run.  The expanded words go into a copy of
+  the commands in an arena that lives as long as the run.  A word stays
+  one word: there is no field splitting.  The one exception is $@ in a
+  command's arguments, which makes one argument of each positional
+  parameter, as "$@" does in sh; elsewhere it joins them as $* does.
+ */
+#define MSH_EXP_SPLIT '\002'   // between the parameters of $@
+#define MSH_EXP_NONE  '\003'   // where a $@ without parameters was
+
+struct msh_exp {
+   char* buf;
+   size_t len;
+   size_t cap;
+   struct msh_arena* arena;
+   int split;        // expanding an argument: $@ may make several
+};
+
+const char* msh_arg0 = "msh";   // $0: the script, or the shell
+char** msh_argv;                // $1 on: the script's or function's arguments
+int msh_argc;
+
+/**
+   @brief Append bytes to an expansion.
+ */
+static void msh_exp_put(struct msh_exp* e, const char* s, size_t n)
+{
+   if (e->len + n + 1 > e->cap) {
+      char* buf;
+
+      e->cap = (e->len + n + 1) * 2;
+      buf = msh_arena_alloc(e->arena, e->cap);
+      if (e->len) {
+         memcpy(buf, e->buf, e->len);
+      }
+      e->buf = buf;
+   }
+   memcpy(e->buf + e->len, s, n);
+   e->len += n;
+}
+
+/**
+   @brief Append a number to an expansion.
+ */
+static void msh_exp_int(struct msh_exp* e, int n)
+{
+   char num[16];
+
+   msh_exp_put(e, num, snprintf(num, sizeof(num), "%d", n));
+}
+
+/**
+   @brief Append the value of a reference to an expansion.
+   @param e The expansion.
+   @param name The name: ?, #, @, *, a number or an identifier, not
+   terminated.
+   @param len Its length.
+   @param sub The subscript of ${name[sub]}, not terminated, or NULL.
+   @param sublen Its length.
+   @return 1, or 0 for a reference that cannot be expanded, leaving e
+   alone.  An unset variable expands to nothing.
+ */
+static int msh_exp_value(struct msh_exp* e, const char* name, size_t len,
+                         const char* sub, size_t sublen)
+{
+   int k;
+
+   if (len == 1 && *name == '?' && !sub) {
+      msh_exp_int(e, msh_last.status);
+      return 1;
+   }
+   if (len == 1 && *name == '#' && !sub) {
+      msh_exp_int(e, msh_argc);
+      return 1;
+   }
+   if (len == 1 && (*name == '@' || *name == '*') && !sub) {
+      char sep = e->split && *name == '@' ? MSH_EXP_SPLIT : ' ';
+      char none = MSH_EXP_NONE;
+
+      if (msh_argc == 0 && sep == MSH_EXP_SPLIT) {
+         msh_exp_put(e, &none, 1);   // so an argument of only $@ goes away
+      }
+      for (k = 0; k < msh_argc; k++) {
+         if (k > 0) {
+            msh_exp_put(e, &sep, 1);
+         }
+         msh_exp_put(e, msh_argv[k], strlen(msh_argv[k]));
+      }
+      return 1;
+   }
+   if (isdigit((unsigned char)*name)) {
+      const char* arg;
+      size_t i;
+
+      if (sub) {
+         return 0;
+      }
+      for (k = 0, i = 0; i < len && k <= msh_argc; i++) {
+         k = k * 10 + (name[i] - '0');
+      }
+      arg = k == 0 ? msh_arg0 : k <= msh_argc ? msh_argv[k - 1] : NULL;
+      if (arg) {
+         msh_exp_put(e, arg, strlen(arg));
+      }
+      return 1;
+   }
+   if (len != 10 || memcmp(name, "PIPESTATUS", 10) != 0) {
+      const char* value;
+
+      if (sub || *name == '?') {
+         return 0;   // variables are not arrays
+      }
+      value = msh_var_getn(name, len);
+      if (value) {
+         msh_exp_put(e, value, strlen(value));
+      }
+      return 1;
+   }
+   if (sub && sublen == 1 && (*sub == '@' || *sub == '*')) {
+      for (k = 0; k < msh_last.nstages; k++) {
+         if (k > 0) {
+            msh_exp_put(e, " ", 1);
+         }
+         msh_exp_int(e, msh_last.pipestatus[k]);
+      }
+      return 1;
+   }
+   k = 0;   // the bare name is element 0
+   if (sub) {
+      char* end;
+
+      k = strtol(sub, &end, 10);
+      if (sublen == 0 || end != sub + sublen) {
+         return 0;
+      }
+   }
+   if (k >= 0 && k < msh_last.nstages) {
+      msh_exp_int(e, msh_last.pipestatus[k]);
+   }
+   return 1;
+}
+
+/**
+   @brief Expand the references in a word: $?, $NAME, ${NAME}, the
+   positional parameters $0 to $9, ${10} on, $#, $@ and $* and, for
+   PIPESTATUS, ${NAME[n]}, ${NAME[@]} and ${NAME[*]}.  One that is
+   malformed is left as it was written.
+   @param word The word, as the lexer left it.
+   @param arena Arena for the result.
+   @param split Whether the word is an argument, where $@ separates the
+   parameters with MSH_EXP_SPLIT, or marks that there are none with
+   MSH_EXP_NONE.
+   @return The expanded word; word itself if it has no references.
+ */
+static char* msh_expand_word(char* word, struct msh_arena* arena, int split)
+{
+   struct msh_exp e = { NULL, 0, 0, arena, split };
+   const char* p = word;
+   const char* mark;
+
+   if (!strchr(word, MSH_EXP_MARK)) {
+      return word;
+   }
+   while ((mark = strchr(p, MSH_EXP_MARK))) {
+      const char* name = mark + 1;
+      const char* end;
+      const char* sub = NULL;
+      size_t sublen = 0;
+      int braced = *name == '{';
+
+      msh_exp_put(&e, p, mark - p);
+      name += braced;
+      end = name;
+      if (*end && strchr("?#@*", *end)) {
+         end++;
+      }
+      else if (isdigit((unsigned char)*end)) {
+         end++;
+         while (braced && isdigit((unsigned char)*end)) {
+            end++;   // $10 is $1 then 0, as in sh
+         }
+      }
+      else {
+         while (*end == '_' || isalnum((unsigned char)*end)) {
+            end++;
+         }
+      }
+      p = end;
+      if (braced && *end == '[' && end > name) {
+         sub = end + 1;
+         sublen = strcspn(sub, "]}");
+         p = sub + sublen + (sub[sublen] == ']');
+      }
+      if (braced && *p++ != '}') {
+         sub = NULL;
+         end = name;   // malformed: written back from the brace on
+      }
+      if (end == name || !msh_exp_value(&e, name, end - name, sub, sublen)) {
+         // as written, with the mark turned back into its $
+         p = braced && end == name ? name : p;
+         msh_exp_put(&e, "$", 1);
+         msh_exp_put(&e, mark + 1, p - mark - 1);
+      }
+   }
+   msh_exp_put(&e, p, strlen(p));
+   e.buf[e.len] = '\0';
+   return e.buf;
+}
+
+/**
+   @brief Expand the words of a with prefix and parse them.
+   @param words The words, NULL-terminated.
+   @param arena Arena for the expanded words and the attributes.
+   @return The attributes.  If they are malformed, an error is printed
+   and they have MSH_ATTR_BAD set, so every stage fails.
+ */
+static struct msh_attrs* msh_expand_attrs(char** words, struct msh_arena* arena)
+{
+   struct msh_attrs* a = msh_arena_alloc(arena, sizeof(struct msh_attrs));
+   char** out;
+   int n, i;
+
+   for (n = 0; words[n]; n++)
+      ;
+   out = msh_arena_alloc(arena, (n + 1) * sizeof(char*));
+   for (i = 0; i < n; i++) {
+      out[i] = msh_expand_word(words[i], arena, 0);
+   }
+   out[n] = NULL;
+   if (msh_attrs_parse(out, a) < 0) {
+      a->set = MSH_ATTR_BAD;
+   }
+   return a;
+}
+
+/**
+   @brief Expand the arguments of a command, making one of each
+   parameter of a $@ and dropping one that was only a $@ with none.
+   @param words The arguments.
+   @param argc Their number.
+   @param arena Arena for the result.
+   @return The expanded arguments, NULL-terminated.
+ */
+static char** msh_expand_args(char** words, int argc, struct msh_arena* arena)
+{
+   char** exp = msh_arena_alloc(arena, (argc + 1) * sizeof(char*));
+   char** argv;
+   int i, n = 0;
+
+   for (i = 0; i < argc; i++) {
+      char* w = msh_expand_word(words[i], arena, 1);
+      char* q = w;
+      char* p;
+
+      exp[i] = NULL;
+      if (w == words[i]) {
+         exp[i] = w;   // nothing expanded, so nothing to split
+         n++;
+         continue;
+      }
+      for (p = w; *p; p++) {
+         if (*p != MSH_EXP_NONE) {
+            n += *p == MSH_EXP_SPLIT;
+            *q++ = *p;
+         }
+      }
+      if (q > w || p == w) {
+         *q = '\0';
+         exp[i] = w;
+         n++;
+      }
+   }
+   argv = msh_arena_alloc(arena, (n + 1) * sizeof(char*));
+   for (i = 0, n = 0; i < argc; i++) {
+      char* w = exp[i];
+      char* sep;
+
+      if (!w) {
+         continue;
+      }
+      while (w != words[i] && (sep = strchr(w, MSH_EXP_SPLIT))) {
+         *sep = '\0';
+         argv[n++] = w;
+         w = sep + 1;
+      }
+      argv[n++] = w;
+   }
+   argv[n] = NULL;
+   return argv;
+}
+
+/**
+   @brief Expand the words and redirection paths of commands.
+   @param cmds The commands.
+   @param n Number of commands.
+   @param arena Arena for what is expanded.
+   @return Expanded copies of the commands; cmds itself if none has
+   anything to expand.
+ */
+struct msh_cmd* msh_expand_cmds(struct msh_cmd* cmds, int n, struct msh_arena* arena)
+{
+   struct msh_cmd* out;
+   int k, i, argc;
+
+   for (k = 0; k < n && !cmds[k].expand; k++)
+      ;
+   if (k == n) {
+      return cmds;
+   }
+   out = msh_arena_alloc(arena, n * sizeof(struct msh_cmd));
+   memcpy(out, cmds, n * sizeof(struct msh_cmd));
+   for (k = 0; k < n; k++) {
+      struct msh_cmd* c = &out[k];
+
+      if (!c->expand) {
+         continue;
+      }
+      for (argc = 0; c->argv[argc]; argc++)
+         ;
+      c->argv = msh_expand_args(c->argv, argc, arena);
+      if (c->nredirs > 0) {
+         c->redirs = memcpy(msh_arena_alloc(arena, c->nredirs * sizeof(struct msh_redir)),
+                            c->redirs, c->nredirs * sizeof(struct msh_redir));
+      }
+      for (i = 0; i < c->nredirs; i++) {
+         c->redirs[i].path = msh_expand_word(c->redirs[i].path, arena, 0);
+      }
+      if (c->nassigns > 0) {
+         c->assigns = memcpy(msh_arena_alloc(arena, c->nassigns * sizeof(char*)),
+                             c->assigns, c->nassigns * sizeof(char*));
+      }
+      for (i = 0; i < c->nassigns; i++) {
+         c->assigns[i] = msh_expand_word(c->assigns[i], arena, 0);
+      }
+      if (c->with && k > 0 && cmds[k - 1].with == c->with) {
+         c->attrs = out[k - 1].attrs;   // one prefix for the whole pipeline
+      }
+      else if (c->with) {
+         c->attrs = msh_expand_attrs(c->with, arena);
+      }
+      c->with = NULL;
+      c->expand = 0;
+   }
+   return out;
+}
+
+/**
+   @brief Start every stage of a pipeline as one job, without waiting.
+   @param cmds The stages.
+   @param nstages Number of stages.
+   @param cmd Command text, for job messages.
+   @param flags MSH_JOB_CTL to give the job its own process group when
+   job control is on; MSH_JOB_INLINE to run the first pure builtin stage
+   in the shell, once the other stages have started.
+   @param fd_in Descriptor for the first stage's stdin, or -1 to inherit.
+   It stays open.
+   @param pipebuf Capacity for the pipes between stages, or 0 for the
+   pipebuf option.
+   @return The job.
+ */
+struct msh_job* msh_job_start(struct msh_cmd* cmds, int nstages, const char* cmd,
+                              int flags, int fd_in, int pipebuf)
+{
+   const struct msh_builtin* b = NULL;
+   struct msh_arena arena = { NULL };
+   struct msh_job* job;
+   struct rusage before;
+   sigset_t old;
+   pid_t pgid = msh_interactive && (flags & MSH_JOB_CTL) ? 0 : -1;
+   pid_t pid;
+   int fd[2];
+   int prev = fd_in;   // read end of the previous stage's pipe
+   int inl = -1;       // stage to run in the shell, if any
+   int inl_in = -1, inl_out = -1;
+   int k, status;
+
+   msh_obuf_flush(&msh_out);   // ahead of anything the job writes
+   if (pipebuf == 0) {
+      pipebuf = msh_pipebuf;
+   }
+   cmds = msh_expand_cmds(cmds, nstages, &arena);   // the job copies what it keeps
+   for (k = 0; (flags & MSH_JOB_INLINE) && inl < 0 && k < nstages; k++) {
+      b = cmds[k].argv[0] ? msh_find_builtin(cmds[k].argv[0]) : NULL;
+      // launch attributes need a process to be set on
+      if (b && (b->flags & MSH_BUILTIN_PURE) && !msh_cmd_attrs(&cmds[k])) {
+         inl = k;
+      }
+   }
+
+   // Nothing may be reaped before its pid is in the table.
+   msh_block_sigchld(&old);
+   job = msh_job_new(cmds, nstages, cmd);
+   clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+   for (k = 0; k < nstages; k++) {
+      fd[0] = fd[1] = -1;
+      if (k < nstages - 1 && pipe2(fd, O_CLOEXEC)) {
+         perror("msh: pipe");
+         break;   // stages not started stay failed
+      }
+      if (fd[1] >= 0 && pipebuf > 0 && fcntl(fd[1], F_SETPIPE_SZ, pipebuf) < 0) {
+         fprintf(stderr, "msh: pipebuf: %d: %s\n", pipebuf, strerror(errno));
+         pipebuf = 0;   // once per job is enough
+      }
+      if (k == inl) {
+         // kept open until the stage has run
+         inl_in = prev;
+         inl_out = fd[1];
+         prev = fd[0];
+         continue;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &job->procs[k].start);
+      if (cmds[k].nassigns > 0) {
+         struct msh_var_saved* saved = msh_var_push(&cmds[k]);
+
+         pid = msh_spawn_stage(&cmds[k], prev, fd[1], pgid, &status);
+         msh_var_pop(&cmds[k], saved);
+      }
+      else {
+         pid = msh_spawn_stage(&cmds[k], prev, fd[1], pgid, &status);
+      }
+      if (pid < 0) {
+         job->procs[k].status = W_EXITCODE(status, 0);
+      }
+      if (pid > 0) {
+         job->procs[k].pid = pid;
+         job->procs[k].state = MSH_PROC_RUNNING;
+         msh_proc_register(&job->procs[k]);
+         if (pgid == 0) {
+            pgid = job->pgid = pid;
+         }
+         if (pgid > 0) {
+            setpgid(pid, pgid);   // also done by the child; avoids a race
+         }
+      }
+      if (prev >= 0 && prev != fd_in) {
+         close(prev);
+      }
+      if (fd[1] >= 0) {
+         close(fd[1]);
+      }
+      prev = fd[0];
+   }
+   if (prev >= 0 && prev != fd_in) {
+      close(prev);
+   }
+   sigprocmask(SIG_SETMASK, &old, NULL);
+
+   if (inl >= 0 && inl < k) {
+      struct msh_proc* p = &job->procs[inl];
+      struct msh_var_saved* saved;
+
+      // The readers are running, so the builtin cannot fill a pipe that
+      // nobody drains.  It runs with the job in the foreground.
+      if (msh_interactive && job->pgid > 0) {
+         tcsetpgrp(STDIN_FILENO, job->pgid);
+      }
+      getrusage(RUSAGE_SELF, &before);
+      clock_gettime(CLOCK_MONOTONIC, &p->start);
+      saved = msh_var_push(&cmds[inl]);
+      msh_run_inline(b, &cmds[inl], inl_in, inl_out);
+      msh_var_pop(&cmds[inl], saved);
+      clock_gettime(CLOCK_MONOTONIC, &p->end);
+      getrusage(RUSAGE_SELF, &p->ru);
+      msh_rusage_since(&p->ru, &before);
+      p->pid = 0;   // ran in the shell: nothing to reap
+      p->status = W_EXITCODE(msh_builtin_status, 0);
+      if (inl_in >= 0 && inl_in != fd_in) {
+         close(inl_in);
+      }
+      if (inl_out >= 0) {
+         close(inl_out);
+      }
+   }
+   msh_arena_reset(&arena);
+   free(arena.head);
+   return job;
+}
+
+/**
+   @brief Wait for a job in the foreground, giving it the terminal.  A
+   finished job is removed from the table; a stopped one stays in it.
+   @param job The job.
+   @param res Receives the job's result, or NULL.
+   @return Its status, as from msh_job_status.
+ */
+int msh_job_wait(struct msh_job* job, struct msh_result* res)
+{
+   sigset_t old;
+   int status;
+   MSH_STAT_BEGIN(t_wait);
+
+   msh_block_sigchld(&old);
+   if (msh_interactive && job->pgid > 0) {
+      tcsetpgrp(STDIN_FILENO, job->pgid);
+   }
+   while (msh_job_state(job) == MSH_PROC_RUNNING) {
+      sigsuspend(&old);
+   }
+   MSH_STAT_END(MSH_ST_WAIT, t_wait);
+   if (msh_interactive) {
+      tcsetpgrp(STDIN_FILENO, msh_shell_pgid);
+   }
+
+   status = msh_job_status(job);
+   if (res) {
+      msh_result_fill(res, job->procs, job->nprocs, &job->start);
+   }
+   if (msh_job_state(job) == MSH_PROC_STOPPED) {
+      struct msh_job** jp;
+
+      // a stopped job becomes the current job
+      for (jp = &msh_jobs; *jp != job; jp = &(*jp)->next)
+         ;
+      *jp = job->next;
+      job->next = msh_jobs;
+      msh_jobs = job;
+      fprintf(stderr, "\n[%d]+  Stopped\t%s\n", job->id, job->cmd);
+   }
+   else {
+      msh_job_free(job);
+   }
+   sigprocmask(SIG_SETMASK, &old, NULL);
+   return status;
+}
+
+/**
+   @brief Continue a stopped job.
+   @param job The job.
+ */
+void msh_job_continue(struct msh_job* job)
+{
+   int k;
+
+   if (job->pgid > 0) {
+      kill(-job->pgid, SIGCONT);
+   }
+   for (k = 0; k < job->nprocs; k++) {
+      if (job->procs[k].state == MSH_PROC_STOPPED) {
+         job->procs[k].state = MSH_PROC_RUNNING;
+         if (job->pgid <= 0) {
+            kill(job->procs[k].pid, SIGCONT);
+         }
+      }
+   }
+}
+
+/**
+   @brief Remove finished background jobs, reporting them when
+   interactive.  Called before each prompt.
+ */
+void msh_job_notify(void)
+{
+   struct msh_job* job;
+   struct msh_job* next;
+   sigset_t old;
+
+   if (!msh_jobs) {
+      return;   // the handler never adds or removes jobs
+   }
+   msh_block_sigchld(&old);
+   for (job = msh_jobs; job; job = next) {
+      next = job->next;
+      if (msh_job_state(job) == MSH_PROC_DONE) {
+         if (msh_interactive) {
+            fprintf(stderr, "[%d]  Done\t%s\n", job->id, job->cmd);
+         }
+         msh_job_free(job);
+      }
+   }
+   sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+   @brief Find a job from a job spec: %n, %%, %+ or a pid.  Call with
+   SIGCHLD blocked.
+   @param spec The spec, or NULL for the current job.
+   @param who Builtin name for error messages.
+   @return The job, or NULL (after printing an error).
+ */
+static struct msh_job* msh_job_find(const char* spec, const char* who)
+{
+   struct msh_job* job;
+   int k;
+
+   if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+      if (!msh_jobs) {
+         fprintf(stderr, "msh: %s: no current job\n", who);
+      }
+      return msh_jobs;
+   }
+   for (job = msh_jobs; job; job = job->next) {
+      if (spec[0] == '%' && atoi(spec + 1) == job->id) {
+         return job;
+      }
+      for (k = 0; spec[0] != '%' && k < job->nprocs; k++) {
+         if (job->procs[k].pid == atoi(spec)) {
+            return job;
+         }
+      }
+   }
+   fprintf(stderr, "msh: %s: %s: no such job\n", who, spec);
+   return NULL;
+}
+
+/**
+   @brief Start over with an empty job table in a forked child that keeps
+   running shell code, so the builtin it runs can start jobs of its own.
+ */
+void msh_subshell_init(void)
+{
+   struct sigaction sa;
+
+   msh_jobs = NULL;   // the parent's jobs; the copies are just dropped
+   memset(msh_proc_table, 0, sizeof(msh_proc_table));
+   msh_interactive = 0;
+   // The server's children would be the parent's, not ours.
+   msh_fs_stop();
+   msh_fs_failed = 1;
+   sa.sa_handler = msh_sigchld;
+   sigemptyset(&sa.sa_mask);
+   sa.sa_flags = SA_RESTART;
+   sigaction(SIGCHLD, &sa, NULL);
+}
+
+/**
+   @brief Set up signals, and the terminal for job control.
+   @param interactive Nonzero when commands come from a terminal.
+ */
+void msh_init_jobs(int interactive)
+{
+   struct sigaction sa;
+   int i;
+
+   sa.sa_handler = msh_sigchld;
+   sigemptyset(&sa.sa_mask);
+   sa.sa_flags = SA_RESTART;
+   sigaction(SIGCHLD, &sa, NULL);
+
+   msh_interactive = interactive;
+   if (!msh_interactive) {
+      return;
+   }
+
+   // Wait until we are in the foreground, then take the terminal.
+   while (tcgetpgrp(STDIN_FILENO) != (msh_shell_pgid = getpgrp())) {
+      kill(-msh_shell_pgid, SIGTTIN);
+   }
+   for (i = 0; i < MSH_NUM_JOB_SIGNALS; i++) {
+      if (msh_job_signals[i] != SIGCHLD) {
+         signal(msh_job_signals[i], SIG_IGN);
+      }
+   }
+   setpgid(0, 0);
+   msh_shell_pgid = getpgrp();
+   tcsetpgrp(STDIN_FILENO, msh_shell_pgid);
+}
+
+/*
+  Job control builtins.
+ */
+
+/**
+   @brief Builtin command: list jobs.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int msh_jobs_builtin(char** args)
+{
+   static const char* state_str[] = { "Running", "Stopped", "Done" };
+   struct msh_job* job;
+   sigset_t old;
+
+   msh_block_sigchld(&old);
+   for (job = msh_jobs; job; job = job->next) {
+      msh_obuf_printf(&msh_out, "[%d]%c  %-8s\t%s\n", job->id, job == msh_jobs ? '+' : ' ',
+             state_str[msh_job_state(job)], job->cmd);
+   }
+   sigprocmask(SIG_SETMASK, &old, NULL);
+   return 1;
+}
+
+/**
+   @brief Builtin command: wait for background jobs to finish.
+   @param args List of args.  args[0] is "wait".  Any further args are
+   job specs; without them, every running job is waited for.
+   @return Always returns 1, to continue executing.
+ */
+int msh_wait(char** args)
+{
+   struct msh_job* job;
+   struct msh_job* next;
+   sigset_t old;
+   int i, busy;
+
+   msh_block_sigchld(&old);
+   if (args[1] == NULL) {
+      do {
+         busy = 0;
+         for (job = msh_jobs; job; job = next) {
+            next = job->next;
+            if (msh_job_state(job) == MSH_PROC_DONE) {
+               msh_job_free(job);
+            }
+            else if (msh_job_state(job) == MSH_PROC_RUNNING) {
+               busy = 1;
+            }
+         }
+         if (busy) {
+            sigsuspend(&old);
+         }
+      } while (busy);
+   }
+   for (i = 1; args[i] != NULL; i++) {
+      job = msh_job_find(args[i], "wait");
+      if (job) {
+         while (msh_job_state(job) == MSH_PROC_RUNNING) {
+            sigsuspend(&old);
+         }
+         msh_builtin_status = msh_job_status(job);   // the last one counts
+         if (msh_job_state(job) == MSH_PROC_DONE) {
+            msh_job_free(job);
+         }
+      }
+      else {
+         msh_builtin_status = 127;
+      }
+   }
+   sigprocmask(SIG_SETMASK, &old, NULL);
+   return 1;
+}
+
+/**
+   @brief Builtin command: continue a job in the foreground.
+   @param args List of args.  args[0] is "fg".  args[1] is an optional
+   job spec.
+   @return Always returns 1, to continue executing.
+ */
+int msh_fg(char** args)
+{
+   struct msh_job* job;
+   sigset_t old;
+
+   msh_block_sigchld(&old);
+   job = msh_job_find(args[1], "fg");
+   if (job) {
+      msh_obuf_printf(&msh_out, "%s\n", job->cmd);
+      msh_obuf_flush(&msh_out);
+      msh_job_continue(job);
+   }
+   sigprocmask(SIG_SETMASK, &old, NULL);
+   if (job) {
+      msh_builtin_status = msh_job_wait(job, NULL);
+   }
+   else {
+      msh_builtin_status = 1;
+   }
+   return 1;
+}
+
+/**
+   @brief Builtin command: continue a stopped job in the background.
+   @param args List of args.  args[0] is "bg".  args[1] is an optional
+   job spec.
+   @return Always returns 1, to continue executing.
+ */
+int msh_bg(char** args)
+{
+   struct msh_job* job;
+   sigset_t old;
+
+   msh_block_sigchld(&old);
+   job = msh_job_find(args[1], "bg");
+   if (job) {
+      msh_obuf_printf(&msh_out, "[%d]+ %s &\n", job->id, job->cmd);
+      msh_job_continue(job);
+   }
+   else {
+      msh_builtin_status = 1;
+   }
+   sigprocmask(SIG_SETMASK, &old, NULL);
+   return 1;
+}
+
+/**
+  @brief Launch a pipeline as a job, and wait for it unless it runs in
+  the background.
+  @param pl The pipeline.
+  @param res Receives the job's result; a background job's status is 0.
+  @return Always returns 1, to continue execution.
+ */
+int msh_launch(struct msh_pipeline* pl, struct msh_result* res)
+{
+   struct msh_job* job = msh_job_start(pl->cmds, pl->ncmds, pl->text,
+                                       MSH_JOB_CTL | (pl->background ? 0 : MSH_JOB_INLINE), -1,
+                                       pl->pipebuf);
+
+   job->timed = pl->timed;   // only read once the job is freed
+   if (!pl->background) {
+      msh_job_wait(job, res);
+      return 1;
+   }
+   if (msh_interactive) {
+      fprintf(stderr, "[%d] %d\n", job->id, (int)job->procs[pl->ncmds - 1].pid);
+   }
+   msh_result_set(res, 0);
+   return 1;
+}
+
+int msh_run_list(struct msh_pipeline* pipes, int npipes);
+
+/**
+  @brief Run an and-or list that ends in "&", such as make && deploy &,
+  as one background job: a forked shell runs the whole list and exits
+  with its status.
+  @param pipes The list's pipelines; the last one is the backgrounded one.
+  @param n How many.
+  @param res Receives the result, whose status is 0.
+  @return Always returns 1, to continue execution.
+ */
+int msh_launch_list(struct msh_pipeline* pipes, int n, struct msh_result* res)
+{
+   char* noargs[] = { NULL };
+   struct msh_cmd shell;
+   struct msh_job* job;
+   struct msh_arena arena = { NULL };
+   sigset_t old;
+   size_t len = 0;
+   char* text;
+   pid_t pid;
+   int i, interactive = msh_interactive;
+
+   for (i = 0; i < n; i++) {
+      len += strlen(pipes[i].text) + 4;
+   }
+   text = msh_arena_alloc(&arena, len + 1);
+   for (len = 0, i = 0; i < n; i++) {
+      len += sprintf(text + len, "%s%s", pipes[i].text,
+                     i == n - 1 ? "" : pipes[i].cond == MSH_COND_AND ? " && " : " || ");
+   }
+   memset(&shell, 0, sizeof(shell));
+   shell.argv = noargs;
+
+   msh_obuf_flush(&msh_out);   // or the child would write it again
+   msh_block_sigchld(&old);
+   job = msh_job_new(&shell, 1, text);
+   msh_arena_reset(&arena);
+   free(arena.head);
+   clock_gettime(CLOCK_MONOTONIC, &job->start);
+   pid = fork();
+   if (pid == 0) {
+      if (interactive) {
+         setpgid(0, 0);
+      }
+      for (i = 0; i < MSH_NUM_JOB_SIGNALS; i++) {
+         signal(msh_job_signals[i], SIG_DFL);
+      }
+      msh_subshell_init();
+      sigprocmask(SIG_SETMASK, &old, NULL);
+      pipes[n - 1].background = 0;   // this copy runs it in the foreground
+      msh_run_list(pipes, n);
+      msh_obuf_flush(&msh_out);
+      _exit(msh_last.status);
+   }
+   else if (pid < 0) {
+      perror("msh");
+   }
+   else {
+      job->procs[0].pid = pid;
+      job->procs[0].state = MSH_PROC_RUNNING;
+      clock_gettime(CLOCK_MONOTONIC, &job->procs[0].start);
+      msh_proc_register(&job->procs[0]);
+      if (interactive) {
+         job->pgid = pid;
+         setpgid(pid, pid);   // also done by the child; avoids a race
+      }
+   }
+   sigprocmask(SIG_SETMASK, &old, NULL);
+   if (pid > 0 && interactive) {
+      fprintf(stderr, "[%d] %d\n", job->id, (int)pid);
+   }
+   msh_result_set(res, 0);
+   return 1;
+}
+
+#define MSH_BUILTIN_ARGS 16   // argv entries copied without malloc
+
+/**
+   @brief Call a builtin on a private copy of its argv.  The argv may
+   belong to a cached parse or a function body, used again by the next
+   run, so whatever the builtin does to the array must not outlive it.
+   @param b The builtin.
+   @param argv The arguments.
+   @return The builtin's result.
+ */
+static int msh_call_builtin(const struct msh_builtin* b, char** argv)
+{
+   char* small[MSH_BUILTIN_ARGS];
+   char** copy = small;
+   int argc, ret;
+
+   for (argc = 0; argv[argc] != NULL; argc++)
+      ;
+   if (argc >= MSH_BUILTIN_ARGS) {
+      copy = malloc((argc + 1) * sizeof(char*));
+      if (!copy) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   memcpy(copy, argv, (argc + 1) * sizeof(char*));
+   ret = (*b->func)(copy);
+   if (copy != small) {
+      free(copy);
+   }
+   return ret;
+}
+
+/**
+   @brief Run a builtin in the shell itself, with the command's
+   redirections applied around it.
+   @param b The builtin.
+   @param cmd The command.
+   @return The builtin's result.
+ */
+int msh_run_builtin(const struct msh_builtin* b, struct msh_cmd* cmd)
+{
+   int saved[cmd->nredirs > 0 ? cmd->nredirs : 1];
+   int i, ret, base;
+
+   msh_builtin_status = 0;
+   if (cmd->nredirs == 0) {
+      ret = msh_call_builtin(b, cmd->argv);
+      msh_obuf_flush(&msh_out);
+      return ret;
+   }
+   if (msh_open_redirs(cmd) < 0) {
+      msh_builtin_status = 1;
+      return 1;
+   }
+   msh_obuf_flush(&msh_out);
+   fflush(stderr);
+   base = msh_redir_base(cmd);
+   for (i = 0; i < cmd->nredirs; i++) {
+      saved[i] = fcntl(cmd->redirs[i].fd, F_DUPFD_CLOEXEC, base);
+      dup2(cmd->redirs[i].src, cmd->redirs[i].fd);
+   }
+
+   ret = msh_call_builtin(b, cmd->argv);
+
+   msh_obuf_flush(&msh_out);
+   fflush(stderr);
+   for (i = cmd->nredirs - 1; i >= 0; i--) {
+      if (saved[i] >= 0) {
+         dup2(saved[i], cmd->redirs[i].fd);
+         close(saved[i]);
+      }
+      else {
+         close(cmd->redirs[i].fd);
+      }
+   }
+   msh_close_redirs(cmd);
+   return ret;
+}
+
+/**
+   @brief Run a builtin in the shell as one stage of a pipeline.
+   SIGPIPE is ignored meanwhile, so a reader that quits early makes the
+   builtin's writes fail instead of killing the shell; the output buffer
+   drops what could not be written.
+   @param b The builtin.
+   @param cmd The stage.
+   @param fd_in Descriptor to use as stdin, or -1 to keep it.
+   @param fd_out Descriptor to use as stdout, or -1 to keep it.
+   @return The builtin's result.
+ */
+int msh_run_inline(const struct msh_builtin* b, struct msh_cmd* cmd, int fd_in,
+                   int fd_out)
+{
+   struct sigaction ign, old_pipe;
+   int saved_in = -1, saved_out = -1;
+   int ret;
+
+   memset(&ign, 0, sizeof(ign));
+   ign.sa_handler = SIG_IGN;
+   sigaction(SIGPIPE, &ign, &old_pipe);
+   msh_obuf_flush(&msh_out);
+   if (fd_in >= 0) {
+      saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+      dup2(fd_in, STDIN_FILENO);
+   }
+   if (fd_out >= 0) {
+      saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+      dup2(fd_out, STDOUT_FILENO);
+   }
+
+   ret = msh_run_builtin(b, cmd);
+
+   if (saved_in >= 0) {
+      dup2(saved_in, STDIN_FILENO);
+      close(saved_in);
+   }
+   if (saved_out >= 0) {
+      dup2(saved_out, STDOUT_FILENO);
+      close(saved_out);
+   }
+   sigaction(SIGPIPE, &old_pipe, NULL);
+   return ret;
+}
+
+/**
+   @brief Execute shell built-in or launch program.
+   @param pl The pipeline.  A lone builtin in the foreground runs in the
+   shell itself; otherwise builtins run in a forked child.
+   @param res Receives the result.  Expansions in pl read msh_last, so
+   it may be that.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int msh_execute(struct msh_pipeline* pl, struct msh_result* res)
+{
+   struct msh_pipeline expanded;
+   struct msh_arena arena = { NULL };
+   struct msh_cmd* cmd;
+   char** args;
+   const struct msh_builtin* b = NULL;
+   int ret = 1, i;
+
+   if (pl->fname) {
+      msh_func_define(pl->fname, pl->fbody);
+      msh_result_set(res, 0);
+      return 1;
+   }
+   expanded = *pl;
+   expanded.cmds = msh_expand_cmds(pl->cmds, pl->ncmds, &arena);
+   pl = &expanded;
+   cmd = &pl->cmds[0];
+   args = cmd->argv;
+
+   if (pl->ncmds == 1 && !pl->background && args[0] != NULL) {
+      MSH_STAT_BEGIN(t_dispatch);
+      b = msh_find_command(args[0]);
+      MSH_STAT_END(MSH_ST_DISPATCH, t_dispatch);
+   }
+   if (pl->ncmds == 1 && !pl->background && (args[0] == NULL || b)) {
+      struct msh_proc self;
+      struct rusage before;
+      int status;
+
+      if (pl->timed) {
+         getrusage(RUSAGE_SELF, &before);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &self.start);
+      if (b && cmd->attrs && (cmd->attrs->set & MSH_ATTR_BAD)) {
+         status = MSH_ATTR_FAILED;
+      }
+      else if (b) {
+         struct msh_var_saved* saved;
+         const struct msh_attrs* with = msh_with;
+
+         MSH_STAT_BEGIN(t_builtin);
+         saved = msh_var_push(cmd);
+         // the builtin itself runs as it is; jobs it starts get the attributes
+         msh_with = msh_cmd_attrs(cmd);
+         ret = msh_run_builtin(b, cmd);
+         msh_with = with;
+         msh_var_pop(cmd, saved);
+         MSH_STAT_END(MSH_ST_BUILTIN, t_builtin);
+         status = msh_builtin_status;
+      }
+      else if (msh_open_redirs(cmd) == 0) {
+         // Only assignments and redirections: set the variables, create
+         // the files, run nothing.
+         for (i = 0; i < cmd->nassigns; i++) {
+            msh_var_assign(cmd->assigns[i], MSH_VAR_KEEP);
+         }
+         msh_close_redirs(cmd);
+         status = 0;
+      }
+      else {
+         status = 1;
+      }
+      self.pid = 0;
+      self.state = MSH_PROC_DONE;
+      self.status = W_EXITCODE(status, 0);
+      self.name = args[0] ? args[0] : "";
+      memset(&self.ru, 0, sizeof(self.ru));
+      if (pl->timed) {
+         clock_gettime(CLOCK_MONOTONIC, &self.end);
+         getrusage(RUSAGE_SELF, &self.ru);
+         msh_rusage_since(&self.ru, &before);
+         msh_time_report(&self, 1, &self.start);
+      }
+      msh_result_fill(res, &self, 1, &self.start);
+   }
+   else {
+      msh_launch(pl, res);
+   }
+   msh_arena_reset(&arena);
+   free(arena.head);
+   return ret;
+}
+
+/**
+   @brief Run a list of pipelines, as parsed from a line.  One after &&
+   runs only if the last status is 0, and one after || only if it is
+   not.  A skipped pipeline leaves the status alone, so a && b || c is
+   (a && b) || c and nothing in it that need not run is ever started.
+   An and-or list that ends in & goes to the background as a whole.
+   @param pipes The pipelines.
+   @param npipes How many.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int msh_run_list(struct msh_pipeline* pipes, int npipes)
+{
+   int i, j, status = 1;
+
+   for (i = 0; status && i < npipes; i++) {
+      if (i > 0 && ((pipes[i - 1].cond == MSH_COND_AND && msh_last.status != 0) ||
+                    (pipes[i - 1].cond == MSH_COND_OR && msh_last.status == 0))) {
+         continue;
+      }
+      for (j = i; j < npipes - 1 && pipes[j].cond != MSH_COND_ALWAYS; j++)
+         ;
+      if (j > i && pipes[j].background) {
+         status = msh_launch_list(&pipes[i], j - i + 1, &msh_last);
+         i = j;
+         continue;
+      }
+      status = msh_execute(&pipes[i], &msh_last);
+   }
+   return status;
+}
+
+#define MSH_RD_BLOCKSIZE 65536   // also the first buffer for scripts read whole
+#define MSH_RL_BUFSIZE 1024
+
+#ifndef MSH_USE_STD_GETLINE
+/*
+  Block-buffered line reader.  Input is pulled in with one read(2) per
+  block; a line that lies entirely inside the block is handed out in
+  place, and only lines that straddle two blocks are copied into the
+  line buffer, which grows geometrically.  Returned lines are valid
+  until the next call.
+ */
+struct msh_reader {
+   int fd;
+   char* block;      // MSH_RD_BLOCKSIZE bytes of raw input
+   size_t pos;       // first unconsumed byte in block
+   size_t len;       // valid bytes in block
+   char* line;       // assembly buffer for lines spanning blocks
+   size_t cap;
+};
+
+struct msh_reader msh_stdin_reader = { STDIN_FILENO };
+
+/**
+   @brief Append bytes to a reader's line buffer, growing it as needed.
+   @param r The reader.
+   @param used Bytes already in the line buffer.
+   @param src Bytes to append.
+   @param n Number of bytes to append.
+ */
+static void msh_reader_append(struct msh_reader* r, size_t used,
+                              const char* src, size_t n)
+{
+   if (used + n + 1 > r->cap) {
+      size_t cap = r->cap ? r->cap : MSH_RL_BUFSIZE;
+      while (used + n + 1 > cap) {
+         cap *= 2;
+      }
+      r->line = realloc(r->line, cap);
+      if (!r->line) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      r->cap = cap;
+   }
+   memcpy(r->line + used, src, n);
+}
+
+/**
+   @brief Read one line, without its newline, from a reader.
+   @param r The reader.
+   @param lenp If not NULL, receives the length of the line.
+   @return The line, or NULL at end of input with nothing left to return.
+ */
+char* msh_reader_getline(struct msh_reader* r, size_t* lenp)
+{
+   size_t used = 0;
+   ssize_t nread;
+
+   if (!r->block) {
+      r->block = malloc(MSH_RD_BLOCKSIZE);
+      if (!r->block) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   while (1) {
+      if (r->pos < r->len) {
+         char* start = r->block + r->pos;
+         size_t avail = r->len - r->pos;
+         char* nl = memchr(start, '\n', avail);
+
+         if (nl && used == 0) {
+            // Whole line is in the block: hand it out in place.
+            *nl = '\0';
+            r->pos += nl - start + 1;
+            if (lenp) {
+               *lenp = nl - start;
+            }
+            return start;
+         }
+         if (nl) {
+            avail = nl - start;
+         }
+         msh_reader_append(r, used, start, avail);
+         used += avail;
+         r->pos += avail;
+         if (nl) {
+            r->pos++;
+            break;
+         }
+      }
+
+      nread = read(r->fd, r->block, MSH_RD_BLOCKSIZE);
+      if (nread < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         perror("msh: read");
+         exit(EXIT_FAILURE);
+      }
+      r->pos = 0;
+      r->len = nread;
+      if (nread == 0) {
+         if (used == 0) {
+            return NULL;
+         }
+         break;  // last line had no newline
+      }
+   }
+
+   r->line[used] = '\0';
+   if (lenp) {
+      *lenp = used;
+   }
+   return r->line;
+}
+#endif
+
+/**
+   @brief Read one raw line from stdin, for the shell or for builtins
+   that consume their input, such as parallel.
+   @param lenp Receives the length of the line.
+   @return The line, valid until the next call, or NULL at end of input.
+ */
+char* msh_input_getline(size_t* lenp)
+{
+#ifdef MSH_USE_STD_GETLINE
+   static char* line = NULL;
+   static size_t bufsize = 0; // have getline allocate a buffer for us
+   ssize_t len;
+
+   msh_obuf_flush(&msh_out);   // the prompt
+   len = getline(&line, &bufsize, stdin);
+   if (len == -1) {
+      if (feof(stdin)) {
+         clearerr(stdin);  // a terminal can be read again after ^D
+         return NULL;
+      }
+      else {
+         perror("msh: getline\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   if (len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+   }
+   *lenp = len;
+   return line;
+#else
+   msh_obuf_flush(&msh_out);   // the prompt
+   return msh_reader_getline(&msh_stdin_reader, lenp);
+#endif
+}
+
+/**
+   @brief Drop input that was read ahead from stdin.  Used by a forked
+   child whose stdin has been replaced.
+ */
+void msh_input_discard(void)
+{
+#ifdef MSH_USE_STD_GETLINE
+   __fpurge(stdin);
+#else
+   msh_stdin_reader.pos = msh_stdin_reader.len = 0;
+#endif
+}
+
+/**
+   @brief Whether stdin has input read ahead that no one has used yet.
+   @return Nonzero if the next line can be had without reading.
+ */
+int msh_input_pending(void)
+{
+#ifdef MSH_USE_STD_GETLINE
+   return 0;   // stdio does not say; the editor reads the terminal itself
+#else
+   return msh_stdin_reader.pos < msh_stdin_reader.len;
+#endif
+}
+
+/*
+  History.  Entries live in a ring of MSH_HIST_MAX slots and the oldest
+  is dropped first.  Their text is interned, so a line entered again
+  shares the copy already held.  For reverse search each entry is listed
+  under every pair of bytes it contains: a search walks the list of the
+  rarest pair in the query and compares only those entries, so it costs
+  what the plausible matches cost, not what the whole history does.
+  The file gets one append per line.  It is mapped only when history is
+  first looked at, and the index is built only by the first search, so
+  a large history slows neither startup nor exit nor a plain up-arrow.
+ */
+#define MSH_HIST_MAX     (1 << 17)   // entries kept; a power of two
+#define MSH_HIST_BUCKETS (1 << 16)   // intern table chains
+#define MSH_HIST_FILE    ".msh_history"   // in $HOME
+
+struct msh_hstr {
+   struct msh_hstr* next;   // intern chain
+   unsigned hash;
+   unsigned refs;           // ring slots holding it
+   size_t len;
+   char text[];
+};
+
+struct msh_hpost {
+   unsigned* seq;           // entries holding one byte pair, oldest first
+   unsigned start;          // entries before it have left the ring
+   unsigned len;
+   unsigned cap;
+};
+
+static struct msh_hstr* msh_hist_ring[MSH_HIST_MAX];
+static struct msh_hstr* msh_hist_table[MSH_HIST_BUCKETS];
+static struct msh_hpost* msh_hist_index;   // 65536 lists, made by the first search
+static unsigned msh_hist_seq;              // entries ever added; entry s is in slot s % MAX
+static int msh_hist_loaded;
+static int msh_hist_indexed;               // the pair index is kept up to date
+static int msh_hist_fd = -2;               // append fd; -2 until opened, -1 without a file
+
+/**
+   @brief Sequence number of the oldest entry still held.
+ */
+static inline unsigned msh_hist_first(void)
+{
+   return msh_hist_seq > MSH_HIST_MAX ? msh_hist_seq - MSH_HIST_MAX : 0;
+}
+
+/**
+   @brief The entry with a sequence number.
+   @param s Sequence number, from msh_hist_first() up to msh_hist_seq.
+ */
+static inline struct msh_hstr* msh_hist_entry(unsigned s)
+{
+   return msh_hist_ring[s & (MSH_HIST_MAX - 1)];
+}
+
+/**
+   @brief The history file's name.
+   @return It, malloc'd, or NULL without $HOME.
+ */
+static char* msh_hist_path(void)
+{
+   const char* home = msh_var_get("HOME");
+   char* path;
+
+   if (!home || !*home) {
+      return NULL;
+   }
+   path = malloc(strlen(home) + sizeof(MSH_HIST_FILE) + 1);
+   if (!path) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   sprintf(path, "%s/%s", home, MSH_HIST_FILE);
+   return path;
+}
+
+/**
+   @brief Find a line's interned copy, making it if there is none.
+   @param line The line.
+   @param len Its length.
+   @return The copy, with refs untouched.
+ */
+static struct msh_hstr* msh_hist_intern(const char* line, size_t len)
+{
+   unsigned h = 2166136261u;
+   struct msh_hstr** bucket;
+   struct msh_hstr* str;
+   size_t i;
+
+   for (i = 0; i < len; i++) {   // msh_strhash, but over a length
+      h = (h ^ (unsigned char)line[i]) * 16777619u;
+   }
+   bucket = &msh_hist_table[h & (MSH_HIST_BUCKETS - 1)];
+   for (str = *bucket; str; str = str->next) {
+      if (str->hash == h && str->len == len && memcmp(str->text, line, len) == 0) {
+         return str;
+      }
+   }
+   str = malloc(sizeof(struct msh_hstr) + len + 1);
+   if (!str) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   str->hash = h;
+   str->refs = 0;
+   str->len = len;
+   memcpy(str->text, line, len);
+   str->text[len] = '\0';
+   str->next = *bucket;
+   *bucket = str;
+   return str;
+}
+
+/**
+   @brief Drop a ring slot's hold on an interned line, freeing it with
+   the last one.
+   @param str The line.
+ */
+static void msh_hist_release(struct msh_hstr* str)
+{
+   struct msh_hstr** p;
+
+   if (--str->refs > 0) {
+      return;
+   }
+   for (p = &msh_hist_table[str->hash & (MSH_HIST_BUCKETS - 1)]; *p != str; p = &(*p)->next)
+      ;
+   *p = str->next;
+   free(str);
+}
+
+/**
+   @brief List a new entry under each byte pair it contains.
+   @param str Its text.
+   @param s Its sequence number.
+ */
+static void msh_hist_index_add(const struct msh_hstr* str, unsigned s)
+{
+   unsigned first = msh_hist_first();
+   size_t i;
+
+   for (i = 0; i + 1 < str->len; i++) {
+      struct msh_hpost* p = &msh_hist_index[(unsigned char)str->text[i] << 8 |
+                                            (unsigned char)str->text[i + 1]];
+
+      if (p->len > p->start && p->seq[p->len - 1] == s) {
+         continue;   // pair seen earlier in this line
+      }
+      while (p->start < p->len && p->seq[p->start] < first) {
+         p->start++;
+      }
+      if (p->len == p->cap) {
+         if (p->start > 0) {
+            memmove(p->seq, p->seq + p->start, (p->len - p->start) * sizeof(unsigned));
+            p->len -= p->start;
+            p->start = 0;
+         }
+         if (p->len == p->cap) {
+            unsigned cap = p->cap ? p->cap * 2 : 4;
+            unsigned* seq = realloc(p->seq, cap * sizeof(unsigned));
+
+            if (!seq) {
+               fprintf(stderr, "msh: allocation error\n");
+               exit(EXIT_FAILURE);
+            }
+            p->seq = seq;
+            p->cap = cap;
+         }
+      }
+      p->seq[p->len++] = s;
+   }
+}
+
+/**
+   @brief Put a line in the ring, unless it repeats the newest entry.
+   @param line The line.
+   @param len Its length.
+ */
+static void msh_hist_push(const char* line, size_t len)
+{
+   struct msh_hstr* str = msh_hist_intern(line, len);
+   unsigned slot = msh_hist_seq & (MSH_HIST_MAX - 1);
+
+   if (msh_hist_seq > 0 && msh_hist_entry(msh_hist_seq - 1) == str) {
+      return;
+   }
+   // Take the reference first: the entry dropped may be this same line.
+   str->refs++;
+   if (msh_hist_seq >= MSH_HIST_MAX) {
+      msh_hist_release(msh_hist_ring[slot]);
+   }
+   msh_hist_ring[slot] = str;
+   if (msh_hist_indexed) {
+      msh_hist_index_add(str, msh_hist_seq);
+   }
+   msh_hist_seq++;
+}
+
+/**
+   @brief Put existing entries in the pair index, the first time history
+   is searched.  Later entries are indexed as they come.
+ */
+static void msh_hist_index_build(void)
+{
+   unsigned s;
+
+   if (msh_hist_indexed) {
+      return;
+   }
+   msh_hist_indexed = 1;
+   msh_hist_index = calloc(1 << 16, sizeof(struct msh_hpost));
+   if (!msh_hist_index) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   for (s = msh_hist_first(); s < msh_hist_seq; s++) {
+      msh_hist_index_add(msh_hist_entry(s), s);
+   }
+}
+
+/**
+   @brief Read the history file into the ring, if that has not been
+   done.  Lines added before this are already in the file.  The file
+   is mapped and only its last MSH_HIST_MAX lines are looked at, since
+   older ones would leave the ring anyway.
+ */
+void msh_hist_load(void)
+{
+   struct stat st;
+   char* path;
+   char* map;
+   char* end;
+   char* p;
+   char* nl;
+   unsigned n = 0;
+   int fd;
+
+   if (msh_hist_loaded) {
+      return;
+   }
+   msh_hist_loaded = 1;
+   path = msh_hist_path();
+   fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+   free(path);
+   if (fd < 0) {
+      return;
+   }
+   if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+       (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+      close(fd);
+      return;
+   }
+   close(fd);
+
+   end = map + st.st_size;
+   if (end[-1] == '\n') {
+      end--;
+   }
+   for (p = end; p > map && n < MSH_HIST_MAX; n++) {
+      nl = memrchr(map, '\n', p - map);
+      p = nl ? nl : map;
+   }
+   if (p > map) {
+      p++;   // on a newline that ends an older line
+   }
+   for (; p < end; p = nl + 1) {
+      nl = memchr(p, '\n', end - p);
+      if (!nl) {
+         nl = end;
+      }
+      if (nl > p) {
+         msh_hist_push(p, nl - p);
+      }
+   }
+   munmap(map, st.st_size);
+}
+
+/**
+   @brief Add a line to history and to the end of the history file.
+   @param line The line, without its newline.
+   @param len Its length.
+ */
+void msh_hist_add(const char* line, size_t len)
+{
+   struct iovec iov[2];
+
+   if (len == 0 || memchr(line, '\n', len)) {
+      return;
+   }
+   if (msh_hist_fd == -2) {
+      char* path = msh_hist_path();
+
+      msh_hist_fd = path ? open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600) : -1;
+      free(path);
+   }
+   if (msh_hist_fd >= 0) {
+      // One write per line keeps lines whole when shells share the file.
+      iov[0].iov_base = (char*)line;
+      iov[0].iov_len = len;
+      iov[1].iov_base = "\n";
+      iov[1].iov_len = 1;
+      if (writev(msh_hist_fd, iov, 2) < 0) {
+         close(msh_hist_fd);
+         msh_hist_fd = -1;
+      }
+   }
+   if (msh_hist_loaded) {
+      msh_hist_push(line, len);
+   }
+}
+
+/**
+   @brief Find the newest entry older than a given one that contains a
+   string.
+   @param q The string.
+   @param qlen Its length, at least 1.
+   @param before Sequence number to search below.
+   @return The entry's sequence number, or -1 if none matches.
+ */
+long msh_hist_search(const char* q, size_t qlen, unsigned before)
+{
+   unsigned first = msh_hist_first();
+   struct msh_hpost* best = NULL;
+   unsigned lo, hi;
+   size_t i;
+
+   msh_hist_index_build();
+   if (qlen < 2) {
+      for (; before > first; before--) {
+         struct msh_hstr* str = msh_hist_entry(before - 1);
+         if (memmem(str->text, str->len, q, qlen)) {
+            return before - 1;
+         }
+      }
+      return -1;
+   }
+   for (i = 0; i + 1 < qlen; i++) {
+      struct msh_hpost* p = &msh_hist_index[(unsigned char)q[i] << 8 | (unsigned char)q[i + 1]];
+
+      if (!best || p->len - p->start < best->len - best->start) {
+         best = p;
+      }
+   }
+   // the newest entry listed below before, then back from there
+   lo = best->start;
+   hi = best->len;
+   while (lo < hi) {
+      unsigned mid = lo + (hi - lo) / 2;
+      if (best->seq[mid] < before) {
+         lo = mid + 1;
+      }
+      else {
+         hi = mid;
+      }
+   }
+   while (lo-- > best->start && best->seq[lo] >= first) {
+      struct msh_hstr* str = msh_hist_entry(best->seq[lo]);
+      if (memmem(str->text, str->len, q, qlen)) {
+         return best->seq[lo];
+      }
+   }
+   return -1;
+}
+
+/*
+  Line editor, for an interactive shell on a terminal.  The terminal is
+  in raw mode only while a line is being read, and the line is redrawn
+  whole after each key, scrolled sideways when wider than the screen.
+  Keys are the emacs ones: ^A ^E ^B ^F and the arrows move, ^H ^D ^K ^U
+  ^W delete, ^P ^N and up/down walk history, ^R searches it backwards,
+  ^L clears the screen and ^C drops the line.
+ */
+#define MSH_KEY_UP    256
+#define MSH_KEY_DOWN  257
+#define MSH_KEY_RIGHT 258
+#define MSH_KEY_LEFT  259
+#define MSH_KEY_HOME  260
+#define MSH_KEY_END   261
+#define MSH_KEY_DEL   262
+#define MSH_CTRL(c)   ((c) & 0x1f)
+
+struct msh_editor {
+   char* buf;            // the line, not NUL-terminated while editing
+   size_t len;
+   size_t pos;           // cursor, as a byte offset
+   size_t cap;
+   const char* prompt;
+   int cols;             // terminal width
+};
+
+static struct termios msh_edit_cooked;   // modes to go back to
+static int msh_edit_israw;
+
+/**
+   @brief Put the terminal back the way the editor found it.
+ */
+static void msh_edit_cooked_mode(void)
+{
+   if (msh_edit_israw) {
+      tcsetattr(STDIN_FILENO, TCSADRAIN, &msh_edit_cooked);
+      msh_edit_israw = 0;
+   }
+}
+
+/**
+   @brief Put the terminal in raw mode.
+   @return 0 on success, -1 if there is no terminal to edit on.
+ */
+static int msh_edit_raw_mode(void)
+{
+   static int registered;
+   const char* term = msh_var_get("TERM");
+   struct termios raw;
+
+   if (!isatty(STDOUT_FILENO) || (term && strcmp(term, "dumb") == 0) ||
+       tcgetattr(STDIN_FILENO, &msh_edit_cooked) < 0) {
+      return -1;
+   }
+   if (!registered) {
+      atexit(msh_edit_cooked_mode);
+      registered = 1;
+   }
+   raw = msh_edit_cooked;
+   raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+   raw.c_cflag |= CS8;
+   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+   raw.c_cc[VMIN] = 1;
+   raw.c_cc[VTIME] = 0;
+   if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) < 0) {
+      return -1;
+   }
+   msh_edit_israw = 1;
+   return 0;
+}
+
+/**
+   @brief Read one byte from the terminal.  Bytes are read one at a
+   time, so that typed-ahead input the line does not use stays for the
+   command that runs next.
+   @return The byte, or -1 at end of input.
+ */
+static int msh_edit_getc(void)
+{
+   unsigned char c;
+   ssize_t n;
+
+   do {
+      n = read(STDIN_FILENO, &c, 1);
+   } while (n < 0 && errno == EINTR);
+   return n == 1 ? c : -1;
+}
+
+/**
+   @brief Read one key, decoding the escape sequences of the arrow and
+   editing keys.
+   @return A byte, an MSH_KEY_* code, 0 for a sequence that means
+   nothing here, or -1 at end of input.
+ */
+static int msh_edit_key(void)
+{
+   int c = msh_edit_getc(), c1, c2;
+
+   if (c != 27) {
+      return c;
+   }
+   c1 = msh_edit_getc();
+   if (c1 != '[' && c1 != 'O') {
+      return c1 < 0 ? -1 : 0;
+   }
+   c2 = msh_edit_getc();
+   if (c2 >= '0' && c2 <= '9') {
+      if (msh_edit_getc() != '~') {
+         return 0;
+      }
+      switch (c2) {
+      case '1': case '7': return MSH_KEY_HOME;
+      case '4': case '8': return MSH_KEY_END;
+      case '3': return MSH_KEY_DEL;
+      }
+      return 0;
+   }
+   switch (c2) {
+   case 'A': return MSH_KEY_UP;
+   case 'B': return MSH_KEY_DOWN;
+   case 'C': return MSH_KEY_RIGHT;
+   case 'D': return MSH_KEY_LEFT;
+   case 'H': return MSH_KEY_HOME;
+   case 'F': return MSH_KEY_END;
+   }
+   return c2 < 0 ? -1 : 0;
+}
+
+/**
+   @brief Screen columns taken by some text: one per character, with
+   UTF-8 continuation bytes taking none.
+ */
+static size_t msh_edit_width(const char* s, size_t n)
+{
+   size_t w = 0, i;
+
+   for (i = 0; i < n; i++) {
+      w += ((unsigned char)s[i] & 0xc0) != 0x80;
+   }
+   return w;
+}
+
+/**
+   @brief Step the cursor over one character.
+   @param e The editor.
+   @param dir 1 for right, -1 for left.
+ */
+static void msh_edit_step(struct msh_editor* e, int dir)
+{
+   if (dir < 0) {
+      while (e->pos > 0 && ((unsigned char)e->buf[--e->pos] & 0xc0) == 0x80)
+         ;
+   }
+   else if (e->pos < e->len) {
+      while (++e->pos < e->len && ((unsigned char)e->buf[e->pos] & 0xc0) == 0x80)
+         ;
+   }
+}
+
+/**
+   @brief Redraw the prompt and the line, and place the cursor.
+   @param e The editor.
+ */
+static void msh_edit_refresh(struct msh_editor* e)
+{
+   size_t plen = strlen(e->prompt);
+   size_t pcols = msh_edit_width(e->prompt, plen);
+   size_t avail = (size_t)e->cols > pcols + 1 ? e->cols - pcols - 1 : 1;
+   size_t start = 0, end;
+
+   // scroll so that the cursor is on screen, then fill what is left
+   while (msh_edit_width(e->buf + start, e->pos - start) >= avail) {
+      while (++start < e->pos && ((unsigned char)e->buf[start] & 0xc0) == 0x80)
+         ;
+   }
+   for (end = e->pos; end < e->len && msh_edit_width(e->buf + start, end - start) < avail; end++)
+      ;
+   while (end < e->len && ((unsigned char)e->buf[end] & 0xc0) == 0x80) {
+      end++;
+   }
+   msh_obuf_putc(&msh_out, '\r');
+   msh_obuf_write(&msh_out, e->prompt, plen);
+   msh_obuf_write(&msh_out, e->buf + start, end - start);
+   msh_obuf_write(&msh_out, "\x1b[0K\r", 5);
+   if (pcols + msh_edit_width(e->buf + start, e->pos - start) > 0) {
+      msh_obuf_printf(&msh_out, "\x1b[%zuC", pcols + msh_edit_width(e->buf + start, e->pos - start));
+   }
+   msh_obuf_flush(&msh_out);
+}
+
+/**
+   @brief Make room in the line.
+   @param e The editor.
+   @param n Bytes that must fit, plus a NUL.
+ */
+static void msh_edit_reserve(struct msh_editor* e, size_t n)
+{
+   if (n + 1 > e->cap) {
+      size_t cap = e->cap ? e->cap : MSH_RL_BUFSIZE;
+      while (n + 1 > cap) {
+         cap *= 2;
+      }
+      e->buf = realloc(e->buf, cap);
+      if (!e->buf) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      e->cap = cap;
+   }
+}
+
+/**
+   @brief Replace the line, leaving the cursor at its end.
+   @param e The editor.
+   @param text New contents.
+   @param len Their length.
+ */
+static void msh_edit_set(struct msh_editor* e, const char* text, size_t len)
+{
+   msh_edit_reserve(e, len);
+   memmove(e->buf, text, len);
+   e->len = e->pos = len;
+}
+
+/**
+   @brief Delete bytes from the line.
+   @param e The editor.
+   @param from First byte to go.
+   @param to Byte after the last.
+ */
+static void msh_edit_delete(struct msh_editor* e, size_t from, size_t to)
+{
+   memmove(e->buf + from, e->buf + to, e->len - to);
+   e->len -= to - from;
+   e->pos = from;
+}
+
+/**
+   @brief Incremental reverse search through history, started by ^R.
+   Typing extends the query, ^R again finds an older match, backspace
+   shortens the query, and ^G or ^C gives back the line as it was.
+   @param e The editor.  Holds the match when the search ends.
+   @return The key that ended the search, for the caller to act on; 0
+   when there is nothing left to do.
+ */
+static int msh_edit_search(struct msh_editor* e)
+{
+   const char* prompt = e->prompt;
+   char sprompt[300];
+   char q[256];
+   size_t qlen = 0, olen = e->len, opos = e->pos;
+   char* orig = malloc(e->len + 1);
+   long match = -1;
+   int failed = 0, c;
+
+   if (!orig) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   memcpy(orig, e->buf, e->len);
+   msh_hist_load();
+   for (;;) {
+      long found = -2;   // no new search
+
+      snprintf(sprompt, sizeof(sprompt), "(%sreverse-i-search)`%.*s': ",
+               failed ? "failed " : "", (int)qlen, q);
+      e->prompt = sprompt;
+      msh_edit_refresh(e);
+
+      c = msh_edit_key();
+      if (c == MSH_CTRL('R')) {
+         if (qlen > 0) {
+            found = msh_hist_search(q, qlen, match >= 0 ? (unsigned)match : msh_hist_seq);
+         }
+      }
+      else if ((c == 127 || c == MSH_CTRL('H')) && qlen > 0) {
+         qlen--;
+         found = qlen > 0 ? msh_hist_search(q, qlen, msh_hist_seq) : -1;
+         if (qlen == 0) {
+            match = -1;
+            msh_edit_set(e, orig, olen);
+            e->pos = opos;
+         }
+      }
+      else if (c >= 32 && c < 256 && c != 127) {
+         if (qlen < sizeof(q)) {
+            q[qlen++] = c;
+            // the current match may well still match
+            found = msh_hist_search(q, qlen, match >= 0 ? (unsigned)match + 1 : msh_hist_seq);
+         }
+      }
+      else if (c == MSH_CTRL('G') || c == MSH_CTRL('C')) {
+         msh_edit_set(e, orig, olen);
+         e->pos = opos;
+         c = 0;
+         break;
+      }
+      else {
+         break;
+      }
+
+      if (found >= 0) {
+         struct msh_hstr* str = msh_hist_entry(found);
+
+         match = found;
+         msh_edit_set(e, str->text, str->len);
+         e->pos = (char*)memmem(str->text, str->len, q, qlen) - str->text;
+      }
+      failed = found == -1 && qlen > 0;
+   }
+   free(orig);
+   e->prompt = prompt;
+   msh_edit_refresh(e);
+   return c;
+}
+
+/**
+   @brief Read a line from the terminal with editing and history.
+   @param prompt The prompt.
+   @param lenp Receives the length of the line.
+   @return The line, valid until the next call, or NULL at end of input.
+   Without a terminal to edit on, the prompt is printed and the line is
+   read as it comes.
+ */
+char* msh_edit_getline(const char* prompt, size_t* lenp)
+{
+   static struct msh_editor e;
+   struct winsize ws;
+   long hpos = -1;        // history entry shown; -1 for the line being typed
+   char* saved = NULL;    // that line, while history is shown
+   size_t savedlen = 0;
+   int c;
+
+   if (msh_input_pending() || msh_edit_raw_mode() < 0) {
+      msh_obuf_write(&msh_out, prompt, strlen(prompt));
+      return msh_input_getline(lenp);
+   }
+   e.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+   e.prompt = prompt;
+   e.len = e.pos = 0;
+   msh_edit_reserve(&e, 0);
+   msh_edit_refresh(&e);
+
+   for (;;) {
+      c = msh_edit_key();
+      if (c == MSH_CTRL('R')) {
+         c = msh_edit_search(&e);
+         hpos = -1;
+      }
+      if (c == -1 && e.len > 0) {
+         goto done;   // input ended partway through a line
+      }
+      if (c == -1 || (c == MSH_CTRL('D') && e.len == 0)) {
+         msh_edit_cooked_mode();
+         free(saved);
+         msh_obuf_putc(&msh_out, '\n');
+         msh_obuf_flush(&msh_out);
+         return NULL;
+      }
+      switch (c) {
+      case MSH_CTRL('D'):
+      case MSH_KEY_DEL:
+         if (e.pos < e.len) {
+            size_t at = e.pos;
+            msh_edit_step(&e, 1);
+            msh_edit_delete(&e, at, e.pos);
+         }
+         break;
+      case '\r':
+      case '\n':
+         goto done;
+      case MSH_CTRL('C'):
+         msh_obuf_write(&msh_out, "^C\n", 3);
+         e.len = e.pos = 0;
+         hpos = -1;
+         break;
+      case 127:
+      case MSH_CTRL('H'):
+         if (e.pos > 0) {
+            size_t at = e.pos;
+            msh_edit_step(&e, -1);
+            msh_edit_delete(&e, e.pos, at);
+         }
+         break;
+      case MSH_CTRL('A'):
+      case MSH_KEY_HOME:
+         e.pos = 0;
+         break;
+      case MSH_CTRL('E'):
+      case MSH_KEY_END:
+         e.pos = e.len;
+         break;
+      case MSH_CTRL('B'):
+      case MSH_KEY_LEFT:
+         msh_edit_step(&e, -1);
+         break;
+      case MSH_CTRL('F'):
+      case MSH_KEY_RIGHT:
+         msh_edit_step(&e, 1);
+         break;
+      case MSH_CTRL('K'):
+         e.len = e.pos;
+         break;
+      case MSH_CTRL('U'):
+         msh_edit_delete(&e, 0, e.pos);
+         break;
+      case MSH_CTRL('W'): {
+         size_t at = e.pos;
+         while (e.pos > 0 && e.buf[e.pos - 1] == ' ') {
+            e.pos--;
+         }
+         while (e.pos > 0 && e.buf[e.pos - 1] != ' ') {
+            e.pos--;
+         }
+         msh_edit_delete(&e, e.pos, at);
+         break;
+      }
+      case MSH_CTRL('L'):
+         msh_obuf_write(&msh_out, "\x1b[H\x1b[2J", 7);
+         break;
+      case MSH_CTRL('P'):
+      case MSH_KEY_UP:
+         msh_hist_load();
+         if ((hpos < 0 ? msh_hist_seq : (unsigned long)hpos) > msh_hist_first()) {
+            struct msh_hstr* str;
+
+            if (hpos < 0) {
+               hpos = msh_hist_seq;
+               free(saved);
+               saved = malloc(e.len + 1);
+               if (!saved) {
+                  fprintf(stderr, "msh: allocation error\n");
+                  exit(EXIT_FAILURE);
+               }
+               memcpy(saved, e.buf, e.len);
+               savedlen = e.len;
+            }
+            str = msh_hist_entry(--hpos);
+            msh_edit_set(&e, str->text, str->len);
+         }
+         break;
+      case MSH_CTRL('N'):
+      case MSH_KEY_DOWN:
+         if (hpos >= 0 && (unsigned long)++hpos < msh_hist_seq) {
+            struct msh_hstr* str = msh_hist_entry(hpos);
+            msh_edit_set(&e, str->text, str->len);
+         }
+         else if (hpos >= 0) {
+            msh_edit_set(&e, saved, savedlen);
+            hpos = -1;
+         }
+         break;
+      default:
+         if (c >= 32 && c < 256) {
+            msh_edit_reserve(&e, e.len + 1);
+            memmove(e.buf + e.pos + 1, e.buf + e.pos, e.len - e.pos);
+            e.buf[e.pos++] = c;
+            e.len++;
+         }
+         break;
+      }
+      msh_edit_refresh(&e);
+   }
+
+done:
+   e.pos = e.len;
+   msh_edit_refresh(&e);
+   msh_obuf_putc(&msh_out, '\n');
+   msh_obuf_flush(&msh_out);
+   msh_edit_cooked_mode();
+   free(saved);
+   e.buf[e.len] = '\0';
+   *lenp = e.len;
+   return e.buf;
+}
+
+/**
+   @brief Read a line of input from stdin.
+   @param arena Arena that will own the line.
+   @return The line from stdin.
+ */
+char* msh_read_line(struct msh_arena* arena)
+{
+   char* line;
+   size_t len;
+   MSH_STAT_BEGIN(t_read);
+
+   if (msh_interactive) {
+      line = msh_edit_getline("$ ", &len);
+      if (line != NULL) {
+         msh_hist_add(line, len);
+      }
+   }
+   else {
+      line = msh_input_getline(&len);
+   }
+   if (line == NULL) {
+      exit(msh_last.status);  // We received an EOF
+   }
+   line = msh_arena_strndup(arena, line, len);
+   MSH_STAT_END(MSH_ST_READ, t_read);
+   return line;
+}
+
+/*
+  Lexer.  One pass over the line produces typed tokens.  Quotes and
+  backslashes are removed in place, so every word is a NUL-terminated
+  view into the line buffer and nothing is copied.
+ */
+#define MSH_TOK_BUFSIZE 64
+
+#define MSH_TOK_WORD   0
+#define MSH_TOK_PIPE   1   // |
+#define MSH_TOK_AMP    2   // &
+#define MSH_TOK_SEMI   3   // ;
+#define MSH_TOK_LESS   4   // [n]<
+#define MSH_TOK_GREAT  5   // [n]>
+#define MSH_TOK_DGREAT 6   // [n]>>
+#define MSH_TOK_LESSAND 7  // [n]<&
+#define MSH_TOK_GREATAND 8 // [n]>&
+#define MSH_TOK_END    9
+#define MSH_TOK_AND    10  // &&
+#define MSH_TOK_OR     11  // ||
+
+struct msh_token {
+   int type;         // MSH_TOK_*
+   char* text;       // the word, for MSH_TOK_WORD
+   int fd;           // the n of a redirection, or -1
+   int start;        // offset of the token's first byte in the line
+   int end;          // offset just past its last byte
+   int expand;       // the word holds MSH_EXP_MARK
+   int assign;       // the word starts with an unquoted NAME=
+   int plain;        // the word has no quotes or backslashes
+};
+
+#define MSH_CH_WORD  0
+#define MSH_CH_SPACE 1
+#define MSH_CH_OP    2
+#define MSH_CH_QUOTE 3
+#define MSH_CH_ESC   4
+#define MSH_CH_END   5
+#define MSH_CH_DOLLAR 6
+
+static const unsigned char msh_lex_class[256] = {
+   ['\0'] = MSH_CH_END,
+   [' '] = MSH_CH_SPACE, ['\t'] = MSH_CH_SPACE, ['\r'] = MSH_CH_SPACE,
+   ['\n'] = MSH_CH_SPACE, ['\a'] = MSH_CH_SPACE,
+   ['|'] = MSH_CH_OP, ['&'] = MSH_CH_OP, [';'] = MSH_CH_OP,
+   ['<'] = MSH_CH_OP, ['>'] = MSH_CH_OP,
+   ['\''] = MSH_CH_QUOTE, ['"'] = MSH_CH_QUOTE,
+   ['\\'] = MSH_CH_ESC,
+   ['$'] = MSH_CH_DOLLAR,
+};
+
+/**
+   @brief Whether a $ followed by this byte starts a reference: $?, a
+   name, a positional parameter, or a braced ${...}.  Any other $ is a
+   plain character.
+ */
+static inline int msh_exp_start(char c)
+{
+   return c == '?' || c == '{' || c == '_' || c == '#' || c == '@' || c == '*' ||
+          isalnum((unsigned char)c);
+}
+
+/**
+   @brief Length of the variable name a string starts with.
+   @param s The string.
+   @return The length, or 0 if s does not start with a name.
+ */
+static size_t msh_name_len(const char* s)
+{
+   size_t n = 0;
+
+   if (*s != '_' && !isalpha((unsigned char)*s)) {
+      return 0;
+   }
+   while (s[n] == '_' || isalnum((unsigned char)s[n])) {
+      n++;
+   }
+   return n;
+}
+
+/**
+   @brief Length of the variable name that a NAME=value string starts
+   with.
+   @param s The string.
+   @return The length of NAME, or 0 if s does not start that way.
+ */
+static size_t msh_assign_len(const char* s)
+{
+   size_t n = msh_name_len(s);
+
+   return s[n] == '=' ? n : 0;
+}
+
+/*
+  Word scanning.  Most of a long line is plain word bytes, which the
+  lexer only copies; msh_scan_word counts them up to the next byte the
+  lexer has to look at, 16 or 32 at a time where the CPU allows.  Its
+  set of stop bytes is the non-word classes of msh_lex_class and must
+  change with them.  Vector loads are aligned, so none reaches into a
+  page past the terminating NUL, which is itself a stop byte.  The first
+  call picks the widest variant the CPU runs.
+ */
+/**
+   @brief Count word bytes, one at a time.
+   @param p Start of the run.
+   @return Bytes before the first stop byte.
+ */
+static size_t msh_scan_scalar(const char* p)
+{
+   const char* s = p;
+
+   while (msh_lex_class[(unsigned char)*s] == MSH_CH_WORD) {
+      s++;
+   }
+   return s - p;
+}
+
+// The stop bytes, for the vector variants.
+#define MSH_SCAN_STOPS(X) \
+   X('\0') X(' ') X('\t') X('\r') X('\n') X('\a') X('|') X('&') X(';') \
+   X('<') X('>') X('\'') X('"') X('\\') X('$')
+
+#ifdef __SSE2__
+#define MSH_SCAN_EQ16(c) | _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+
+/**
+   @brief Stop bytes in 16 bytes, as a bit mask.
+ */
+static inline unsigned msh_scan_mask16(__m128i v)
+{
+   return _mm_movemask_epi8(_mm_setzero_si128() MSH_SCAN_STOPS(MSH_SCAN_EQ16));
+}
+
+/**
+   @brief Count word bytes, 16 at a time with SSE2.
+   @param p Start of the run.
+   @return Bytes before the first stop byte.
+ */
+static size_t msh_scan_sse2(const char* p)
+{
+   size_t off = (uintptr_t)p & 15;
+   const __m128i* a = (const __m128i*)(p - off);
+   unsigned mask = msh_scan_mask16(_mm_load_si128(a)) >> off;
+
+   if (mask) {
+      return __builtin_ctz(mask);
+   }
+   for (a++;; a++) {
+      mask = msh_scan_mask16(_mm_load_si128(a));
+      if (mask) {
+         return (const char*)a - p + __builtin_ctz(mask);
+      }
+   }
+}
+
+/**
+   @brief Stop bytes in 32 bytes, as a bit mask.  A byte stops when the
+   group bits looked up by its low nibble and by its high nibble share a
+   bit; a group is the stop bytes of one high nibble, with 5x and 7x
+   sharing one since both hold only \ and |.
+ */
+__attribute__((target("avx2")))
+static inline unsigned msh_scan_mask32(__m256i v)
+{
+   const __m256i lo_groups = _mm256_setr_epi8(
+      3, 0, 2, 0, 2, 0, 2, 3, 0, 1, 1, 4, 12, 1, 4, 0,
+      3, 0, 2, 0, 2, 0, 2, 3, 0, 1, 1, 4, 12, 1, 4, 0);
+   const __m256i hi_groups = _mm256_setr_epi8(
+      1, 0, 2, 4, 0, 8, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+      1, 0, 2, 4, 0, 8, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0);
+   const __m256i nibble = _mm256_set1_epi8(0x0f);
+   __m256i lo = _mm256_shuffle_epi8(lo_groups, _mm256_and_si256(v, nibble));
+   __m256i hi = _mm256_shuffle_epi8(hi_groups,
+                                    _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+   __m256i none = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+
+   return ~(unsigned)_mm256_movemask_epi8(none);
+}
+
+/**
+   @brief Count word bytes, 32 at a time with AVX2.
+   @param p Start of the run.
+   @return Bytes before the first stop byte.
+ */
+__attribute__((target("avx2")))
+static size_t msh_scan_avx2(const char* p)
+{
+   size_t off = (uintptr_t)p & 31;
+   const __m256i* a = (const __m256i*)(p - off);
+   unsigned mask = msh_scan_mask32(_mm256_load_si256(a)) >> off;
+
+   if (mask) {
+      return __builtin_ctz(mask);
+   }
+   for (a++;; a++) {
+      mask = msh_scan_mask32(_mm256_load_si256(a));
+      if (mask) {
+         return (const char*)a - p + __builtin_ctz(mask);
+      }
+   }
+}
+
+/**
+   @brief Whether the CPU runs AVX2.
+ */
+static int msh_scan_have_avx2(void)
+{
+   return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef __ARM_NEON
+#define MSH_SCAN_EQN(c) | vceqq_u8(v, vdupq_n_u8(c))
+
+/**
+   @brief Stop bytes in 16 bytes, as a mask of four bits per byte.
+ */
+static inline uint64_t msh_scan_mask_neon(uint8x16_t v)
+{
+   uint8x16_t eq = vdupq_n_u8(0) MSH_SCAN_STOPS(MSH_SCAN_EQN);
+
+   return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+/**
+   @brief Count word bytes, 16 at a time with NEON.
+   @param p Start of the run.
+   @return Bytes before the first stop byte.
+ */
+static size_t msh_scan_neon(const char* p)
+{
+   size_t off = (uintptr_t)p & 15;
+   const uint8_t* a = (const uint8_t*)(p - off);
+   uint64_t mask = msh_scan_mask_neon(vld1q_u8(a)) >> (4 * off);
+
+   if (mask) {
+      return __builtin_ctzll(mask) / 4;
+   }
+   for (a += 16;; a += 16) {
+      mask = msh_scan_mask_neon(vld1q_u8(a));
+      if (mask) {
+         return (const char*)a - p + __builtin_ctzll(mask) / 4;
+      }
+   }
+}
+#endif
+
+struct msh_scanner {
+   const char* name;
+   size_t (*scan)(const char*);
+   int (*usable)(void);   // NULL if the build's target always runs it
+};
+
+// Narrowest first.
+static const struct msh_scanner msh_scanners[] = {
+   { "scalar", &msh_scan_scalar },
+#ifdef __SSE2__
+   { "sse2", &msh_scan_sse2 },
+   { "avx2", &msh_scan_avx2, &msh_scan_have_avx2 },
+#endif
+#ifdef __ARM_NEON
+   { "neon", &msh_scan_neon },
+#endif
+};
+
+#define MSH_NUM_SCANNERS (int)(sizeof(msh_scanners) / sizeof(struct msh_scanner))
+
+static size_t msh_scan_pick(const char* p);
+
+size_t (*msh_scan_word)(const char* p) = &msh_scan_pick;
+
+/**
+   @brief Point msh_scan_word at the widest usable scanner, then scan.
+   @param p Start of the run.
+   @return Bytes before the first stop byte.
+ */
+static size_t msh_scan_pick(const char* p)
+{
+   int i;
+
+   for (i = MSH_NUM_SCANNERS - 1; i > 0; i--) {
+      if (!msh_scanners[i].usable || msh_scanners[i].usable()) {
+         break;
+      }
+   }
+   msh_scan_word = msh_scanners[i].scan;
+   return msh_scan_word(p);
+}
+
+const char* msh_src_name;   // script being run, for error messages
+int msh_src_line;
+
+/**
+   @brief Start an error message, naming the script line if there is one.
+ */
+void msh_error_prefix(void)
+{
+   if (msh_src_name) {
+      fprintf(stderr, "msh: %s: line %d: ", msh_src_name, msh_src_line);
+   }
+   else {
+      fprintf(stderr, "msh: ");
+   }
+}
+
+/**
+   @brief Lex one operator.
+   @param r Points at the operator; advanced past it.
+   @param t Token to fill in.
+ */
+static void msh_lex_op(char** r, struct msh_token* t)
+{
+   char* p = *r;
+
+   switch (*p++) {
+   case '|':
+      t->type = MSH_TOK_PIPE;
+      if (*p == '|') {
+         t->type = MSH_TOK_OR;
+         p++;
+      }
+      break;
+   case '&':
+      t->type = MSH_TOK_AMP;
+      if (*p == '&') {
+         t->type = MSH_TOK_AND;
+         p++;
+      }
+      break;
+   case ';':
+      t->type = MSH_TOK_SEMI;
+      break;
+   case '<':
+      t->type = MSH_TOK_LESS;
+      if (*p == '&') {
+         t->type = MSH_TOK_LESSAND;
+         p++;
+      }
+      break;
+   default:
+      t->type = MSH_TOK_GREAT;
+      if (*p == '>') {
+         t->type = MSH_TOK_DGREAT;
+         p++;
+      }
+      else if (*p == '&') {
+         t->type = MSH_TOK_GREATAND;
+         p++;
+      }
+      break;
+   }
+   t->text = NULL;
+   *r = p;
+}
+
+/**
+   @brief Split a line into tokens.
+   @param line The line.  Modified in place.
+   @param arena Arena for the token array.
+   @return Token array ending with an MSH_TOK_END token, or NULL (after
+   printing an error) on an unterminated quote.
+ */
+struct msh_token* msh_lex(char* line, struct msh_arena* arena)
+{
+   int bufsize = MSH_TOK_BUFSIZE, position = 0;
+   struct msh_token* tokens = msh_arena_alloc(arena, bufsize * sizeof(struct msh_token));
+   struct msh_token* tokens_backup;
+   struct msh_token* t;
+   char* r = line;   // read position
+   char* w;          // write position of the current word
+   char* p;
+   char quote;
+   size_t n;
+
+   while (1) {
+      while (msh_lex_class[(unsigned char)*r] == MSH_CH_SPACE) {
+         r++;
+      }
+      if (*r == '#') {
+         *r = '\0';   // a comment runs to the end of the line
+      }
+
+      // room for this token, a trailing operator and the end marker
+      if (position + 3 > bufsize) {
+         bufsize *= 2;
+         tokens_backup = tokens;
+         tokens = msh_arena_alloc(arena, bufsize * sizeof(struct msh_token));
+         memcpy(tokens, tokens_backup, position * sizeof(struct msh_token));
+      }
+      t = &tokens[position++];
+      t->start = r - line;
+      t->fd = -1;
+      t->expand = 0;
+      t->assign = 0;
+      t->plain = 0;
+
+      // digits right before < or > name the descriptor: 2>file
+      for (p = r; *p >= '0' && *p <= '9'; p++)
+         ;
+      if (p != r && (*p == '<' || *p == '>')) {
+         t->fd = atoi(r);
+         r = p;
+      }
+
+      if (*r == '\0') {
+         t->type = MSH_TOK_END;
+         t->text = NULL;
+         t->end = t->start;
+         return tokens;
+      }
+      if (msh_lex_class[(unsigned char)*r] == MSH_CH_OP) {
+         msh_lex_op(&r, t);
+         t->end = r - line;
+         continue;
+      }
+
+      t->type = MSH_TOK_WORD;
+      t->text = w = r;
+      t->assign = msh_assign_len(r) > 0;
+      while (1) {
+         switch (msh_lex_class[(unsigned char)*r]) {
+         case MSH_CH_WORD:
+            n = msh_scan_word(r);
+            if (w != r) {
+               memmove(w, r, n);   // behind, after a quote or backslash
+            }
+            w += n;
+            r += n;
+            continue;
+         case MSH_CH_ESC:
+            r++;
+            if (*r != '\0') {
+               *w++ = *r++;
+            }
+            continue;
+         case MSH_CH_DOLLAR:
+            if (msh_exp_start(r[1])) {
+               *r = MSH_EXP_MARK;
+               t->expand = 1;
+            }
+            *w++ = *r++;
+            continue;
+         case MSH_CH_QUOTE:
+            quote = *r++;
+            while (*r != quote) {
+               if (*r == '\0') {
+                  msh_error_prefix();
+                  fprintf(stderr, "syntax error: unterminated %c\n", quote);
+                  return NULL;
+               }
+               if (quote == '"' && *r == '\\' && strchr("\"\\$`", r[1])) {
+                  r++;
+               }
+               else if (quote == '"' && *r == '$' && msh_exp_start(r[1])) {
+                  *r = MSH_EXP_MARK;
+                  t->expand = 1;
+               }
+               *w++ = *r++;
+            }
+            r++;
+            continue;
+         }
+         break;
+      }
+      t->end = r - line;
+      t->plain = w - t->text == t->end - t->start;
+
+      // The terminator may land on the byte that ended the word, so
+      // consume that byte first.
+      if (msh_lex_class[(unsigned char)*r] == MSH_CH_SPACE) {
+         r++;
+      }
+      else if (msh_lex_class[(unsigned char)*r] == MSH_CH_OP) {
+         t = &tokens[position++];
+         t->start = r - line;
+         t->fd = -1;
+         t->expand = 0;
+         t->assign = 0;
+         t->plain = 0;
+         msh_lex_op(&r, t);
+         t->end = r - line;
+      }
+      *w = '\0';
+   }
+}
+
+/**
+   @brief Report a syntax error at a token.
+   @param t The token.
+ */
+static void msh_syntax_error(struct msh_token* t)
+{
+   static const char* op_str[] = {
+      "", "|", "&", ";", "<", ">", ">>", "<&", ">&", "newline", "&&", "||"
+   };
+
+   msh_error_prefix();
+   fprintf(stderr, "syntax error near `%s'\n",
+           t->type == MSH_TOK_WORD ? t->text : op_str[t->type]);
+}
+
+/**
+   @brief Whether a word was written without quotes or backslashes.
+   Tokens from an alias keep this although their span is the alias name's.
+   @param t The word's token.
+ */
+static int msh_tok_plain(const struct msh_token* t)
+{
+   return t->plain;
+}
+
+/**
+   @brief Recognize a function definition, name() { list; }, at a token.
+   The body is only checked for its closing brace here; it is parsed
+   when the function is first called.
+   @param tp Points at the token.  Advanced past the definition, to the
+   ; or end of line after it.
+   @param raw Unmodified copy of the line.
+   @param arena Arena for the name and body.
+   @param pl Pipeline whose fname and fbody are set.
+   @return 1 for a definition, 0 if there is none, -1 after printing a
+   syntax error.
+ */
+static int msh_parse_funcdef(struct msh_token** tp, const char* raw,
+                             struct msh_arena* arena, struct msh_pipeline* pl)
+{
+   struct msh_token* t = *tp;
+   struct msh_token* open;
+   size_t len, i;
+   int depth;
+
+   if (t->type != MSH_TOK_WORD || !msh_tok_plain(t)) {
+      return 0;
+   }
+   len = strlen(t->text);
+   if (len > 2 && strcmp(t->text + len - 2, "()") == 0) {
+      len -= 2;
+      open = t + 1;
+   }
+   else if (t[1].type == MSH_TOK_WORD && msh_tok_plain(&t[1]) &&
+            strcmp(t[1].text, "()") == 0) {
+      open = t + 2;
+   }
+   else {
+      return 0;
+   }
+   if (open->type != MSH_TOK_WORD || !msh_tok_plain(open) || strcmp(open->text, "{") != 0) {
+      return 0;
+   }
+   for (i = 0; i < len; i++) {
+      if (!isalnum((unsigned char)t->text[i]) && !strchr("_-.", t->text[i])) {
+         msh_error_prefix();
+         fprintf(stderr, "%.*s: not a valid function name\n", (int)len, t->text);
+         return -1;
+      }
+   }
+
+   for (*tp = open + 1, depth = 1; (*tp)->type != MSH_TOK_END; (*tp)++) {
+      if ((*tp)->type == MSH_TOK_WORD && msh_tok_plain(*tp)) {
+         if (strcmp((*tp)->text, "{") == 0) {
+            depth++;
+         }
+         else if (strcmp((*tp)->text, "}") == 0 && --depth == 0) {
+            break;
+         }
+      }
+   }
+   if ((*tp)->type == MSH_TOK_END || ((*tp)[1].type != MSH_TOK_END &&
+                                      (*tp)[1].type != MSH_TOK_SEMI)) {
+      msh_syntax_error((*tp)->type == MSH_TOK_END ? *tp : *tp + 1);
+      return -1;
+   }
+   pl->fname = msh_arena_strndup(arena, t->text, len);
+   pl->fbody = msh_arena_strndup(arena, raw + open->end, (*tp)->start - open->end);
+   (*tp)++;
+   return 1;
+}
+
+/**
+   @brief Parse a "with ATTR=VALUE... --" prefix.  Attributes that hold
+   references are kept as words in pl->with, to be expanded and parsed
+   when the pipeline runs; the others are parsed now, into pl->attrs.
+   @param tp Points at the with token.  Advanced to the -- token.
+   @param pl The pipeline.
+   @param arena Arena for the attributes.
+   @return 0, or -1 (after printing an error) if an attribute is
+   malformed or the -- is missing.
+ */
+static int msh_parse_attrs(struct msh_token** tp, struct msh_pipeline* pl,
+                           struct msh_arena* arena)
+{
+   struct msh_token* with = *tp;
+   struct msh_token* t;
+   char** words;
+   int n, expand = 0;
+
+   for (t = with + 1; t->type == MSH_TOK_WORD; t++) {
+      if (msh_tok_plain(t) && strcmp(t->text, "--") == 0) {
+         break;
+      }
+      expand |= t->expand;
+   }
+   if (t->type != MSH_TOK_WORD) {
+      msh_error_prefix();
+      fprintf(stderr, "with: expected ATTR=VALUE... --\n");
+      return -1;
+   }
+   *tp = t;
+   words = msh_arena_alloc(arena, (t - with) * sizeof(char*));
+   for (n = 0; with + 1 + n < t; n++) {
+      words[n] = with[1 + n].text;
+   }
+   words[n] = NULL;
+   if (expand) {
+      pl->with = words;
+      return 0;
+   }
+   pl->attrs = msh_arena_alloc(arena, sizeof(struct msh_attrs));
+   return msh_attrs_parse(words, pl->attrs);
+}
+
+/**
+   @brief Parse tokens into a list of pipelines.
+   @param tokens Tokens from msh_lex.
+   @param raw Unmodified copy of the line, for the pipelines' text.
+   @param arena Arena for the parsed structure.
+   @param npipesp Receives the number of pipelines, or -1 on an error.
+   @return The pipelines, or NULL (after printing an error) on a syntax
+   error.
+ */
+struct msh_pipeline* msh_parse(struct msh_token* tokens, const char* raw,
+                               struct msh_arena* arena, int* npipesp)
+{
+   struct msh_pipeline* pipes;
+   struct msh_pipeline* pl;
+   struct msh_cmd* cmds;
+   struct msh_cmd* c;
+   struct msh_redir* redirs;
+   struct msh_token* t;
+   struct msh_token* first;
+   char** words;
+   int ntok, npipes = 0, ncmds = 0, nwords = 0, nredirs = 0;
+
+   *npipesp = -1;
+   for (ntok = 0; tokens[ntok].type != MSH_TOK_END; ntok++)
+      ;
+   if (ntok == 0) {
+      *npipesp = 0;
+      return NULL;
+   }
+
+   // Every pool is bounded by the token count, so one pass fills them.
+   pipes = msh_arena_alloc(arena, (ntok + 1) * sizeof(struct msh_pipeline));
+   cmds = msh_arena_alloc(arena, (ntok + 1) * sizeof(struct msh_cmd));
+   words = msh_arena_alloc(arena, (ntok + 1) * sizeof(char*));
+   redirs = msh_arena_alloc(arena, (ntok + 1) * sizeof(struct msh_redir));
+
+   t = tokens;
+   while (t->type != MSH_TOK_END) {
+      pl = &pipes[npipes++];
+      pl->cmds = &cmds[ncmds];
+      pl->ncmds = 0;
+      pl->background = 0;
+      pl->timed = 0;
+      pl->pipebuf = 0;
+      pl->cond = MSH_COND_ALWAYS;
+      pl->fname = NULL;
+      pl->attrs = NULL;
+      pl->with = NULL;
+      first = t;
+      switch (msh_parse_funcdef(&t, raw, arena, pl)) {
+      case -1:
+         return NULL;
+      case 1:
+         pl->text = msh_arena_strndup(arena, raw + first->start, t[-1].end - first->start);
+         if (t->type != MSH_TOK_END) {
+            t++;
+         }
+         continue;
+      }
+      // Prefixes, recognized only when unquoted: time is a keyword,
+      // not a builtin, pipebuf=SIZE overrides the option, and with sets
+      // launch attributes.
+      for (;; t++) {
+         if (t->type == MSH_TOK_WORD && msh_tok_plain(t) && strcmp(t->text, "time") == 0) {
+            pl->timed = 1;
+         }
+         else if (t->type == MSH_TOK_WORD && msh_tok_plain(t) &&
+                  strcmp(t->text, "with") == 0 && !pl->attrs && !pl->with) {
+            if (msh_parse_attrs(&t, pl, arena) < 0) {
+               return NULL;
+            }
+         }
+         else if (t->type == MSH_TOK_WORD && t->end - t->start > 8 &&
+                  memcmp(raw + t->start, "pipebuf=", 8) == 0 &&
+                  (size_t)(t->end - t->start) == strlen(t->text)) {
+            long n = msh_parse_size(t->text + 8);
+
+            if (n <= 0) {
+               msh_error_prefix();
+               fprintf(stderr, "pipebuf: %s: bad size\n", t->text + 8);
+               return NULL;
+            }
+            pl->pipebuf = n;
+         }
+         else {
+            break;
+         }
+      }
+
+      while (1) {
+         c = &cmds[ncmds++];
+         pl->ncmds++;
+         c->argv = c->assigns = &words[nwords];
+         c->redirs = &redirs[nredirs];
+         c->nredirs = 0;
+         c->nassigns = 0;
+         c->expand = pl->with != NULL;
+         c->attrs = pl->attrs;
+         c->with = pl->with;
+
+         for (;; t++) {
+            if (t->type == MSH_TOK_WORD) {
+               if (t->assign && c->argv == &words[nwords]) {
+                  c->argv++;   // still ahead of the command name
+                  c->nassigns++;
+               }
+               words[nwords++] = t->text;
+               c->expand |= t->expand;
+            }
+            else if (t->type >= MSH_TOK_LESS && t->type <= MSH_TOK_GREATAND) {
+               struct msh_redir* r = &redirs[nredirs];
+
+               if (t[1].type != MSH_TOK_WORD) {
+                  msh_syntax_error(&t[1]);
+                  return NULL;
+               }
+               r->type = t->type == MSH_TOK_LESS ? MSH_REDIR_IN :
+                         t->type == MSH_TOK_GREAT ? MSH_REDIR_OUT :
+                         t->type == MSH_TOK_DGREAT ? MSH_REDIR_APPEND :
+                         MSH_REDIR_DUP;
+               r->fd = t->fd >= 0 ? t->fd :
+                       t->type == MSH_TOK_LESS || t->type == MSH_TOK_LESSAND ? 0 : 1;
+               r->path = (++t)->text;
+               c->expand |= t->expand;
+               if (r->type == MSH_REDIR_DUP && strspn(r->path, "0123456789") != strlen(r->path)) {
+                  fprintf(stderr, "msh: %s: bad file descriptor\n", r->path);
+                  return NULL;
+               }
+               nredirs++;
+               c->nredirs++;
+            }
+            else {
+               break;
+            }
+         }
+         words[nwords++] = NULL;
+
+         if (c->argv[0] == NULL && c->nredirs == 0 && c->nassigns == 0 &&
+             !(pl->timed && pl->ncmds == 1 && t->type != MSH_TOK_PIPE)) {
+            // a bare time is allowed, and times nothing
+            msh_syntax_error(t);
+            return NULL;
+         }
+         if (t->type != MSH_TOK_PIPE) {
+            break;
+         }
+         t++;
+      }
+
+      pl->text = msh_arena_strndup(arena, raw + first->start,
+                                   t[-1].end - first->start);
+      if (t->type == MSH_TOK_AMP) {
+         pl->background = 1;
+      }
+      else if (t->type == MSH_TOK_AND || t->type == MSH_TOK_OR) {
+         pl->cond = t->type == MSH_TOK_AND ? MSH_COND_AND : MSH_COND_OR;
+         if (t[1].type == MSH_TOK_END) {
+            msh_syntax_error(&t[1]);
+            return NULL;
+         }
+      }
+      if (t->type != MSH_TOK_END) {
+         t++;
+      }
+   }
+
+   *npipesp = npipes;
+   return pipes;
+}
+
+struct msh_token* msh_alias_expand(struct msh_token* tokens, struct msh_arena* arena);
+
+/**
+   @brief Lex and parse one line.
+   @param line The line.  Modified in place.
+   @param arena Arena for everything parsed from the line.
+   @param npipesp Receives the number of pipelines, or -1 on an error.
+   @return The pipelines.
+ */
+struct msh_pipeline* msh_parse_line(char* line, struct msh_arena* arena, int* npipesp)
+{
+   struct msh_pipeline* pipes = NULL;
+   struct msh_token* tokens;
+   char* raw = msh_arena_strndup(arena, line, strlen(line));
+   MSH_STAT_BEGIN(t_parse);
+
+   tokens = msh_lex(line, arena);
+   if (tokens) {
+      tokens = msh_alias_expand(tokens, arena);
+      pipes = msh_parse(tokens, raw, arena, npipesp);
+   }
+   else {
+      *npipesp = -1;
+   }
+   MSH_STAT_END(MSH_ST_PARSE, t_parse);
+   return pipes;
+}
+
+/*
+  Parse cache.  Parsed lines are kept in a direct-mapped table keyed by
+  a hash of the raw text, each entry in its own arena, so a line that
+  comes back skips lexing and parsing.  An entry is pinned while its
+  pipelines run, because a builtin such as parallel may parse lines of
+  its own in the meantime.
+ */
+#define MSH_PCACHE_SIZE 64   // entries, power of two
+
+struct msh_pcache_entry {
+   struct msh_arena arena;   // owns the key and the parsed pipelines
+   char* key;                // raw line, or NULL if the entry is empty
+   size_t len;
+   unsigned hash;
+   struct msh_pipeline* pipes;
+   int npipes;
+   int busy;                 // pins held by running lines
+};
+
+static struct msh_pcache_entry msh_pcache[MSH_PCACHE_SIZE];
+unsigned long msh_pcache_hits;
+unsigned long msh_pcache_misses;
+
+/**
+   @brief Parse a line through the parse cache.
+   @param line The line.  Left untouched on a hit.
+   @param arena Arena to parse into when the line cannot be cached.
+   @param npipesp Receives the number of pipelines, or -1 on an error.
+   @param entryp Receives the pinned cache entry, or NULL; release it
+   with msh_pcache_unpin once the pipelines are no longer used.
+   @return The pipelines.
+ */
+struct msh_pipeline* msh_parse_cached(char* line, struct msh_arena* arena,
+                                      int* npipesp, struct msh_pcache_entry** entryp)
+{
+   struct msh_pcache_entry* e;
+   size_t len = strlen(line);
+   unsigned h = msh_strhash(line);
+
+   *entryp = NULL;
+   e = &msh_pcache[h & (MSH_PCACHE_SIZE - 1)];
+   if (e->key && e->hash == h && e->len == len && memcmp(e->key, line, len) == 0) {
+      msh_pcache_hits++;
+      e->busy++;
+      *entryp = e;
+      *npipesp = e->npipes;
+      return e->pipes;
+   }
+
+   msh_pcache_misses++;
+   if (e->busy) {
+      return msh_parse_line(line, arena, npipesp);
+   }
+   e->key = NULL;
+   msh_arena_reset(&e->arena);
+   e->pipes = msh_parse_line(msh_arena_strndup(&e->arena, line, len), &e->arena,
+                             npipesp);
+   if (*npipesp < 0) {
+      return NULL;   // errors are not cached, so they are reported again
+   }
+   e->key = msh_arena_strndup(&e->arena, line, len);
+   e->len = len;
+   e->hash = h;
+   e->npipes = *npipesp;
+   e->busy = 1;
+   *entryp = e;
+   return e->pipes;
+}
+
+/**
+   @brief Release a pin taken by msh_parse_cached.
+   @param e The entry, or NULL.
+ */
+void msh_pcache_unpin(struct msh_pcache_entry* e)
+{
+   if (e) {
+      e->busy--;
+   }
+}
+
+/**
+   @brief Empty the parse cache, for when the meaning of a line changes.
+   Pinned entries are left alone.
+ */
+void msh_pcache_clear(void)
+{
+   int i;
+
+   for (i = 0; i < MSH_PCACHE_SIZE; i++) {
+      if (!msh_pcache[i].busy) {
+         msh_pcache[i].key = NULL;
+      }
+   }
+}
+
+/*
+  Aliases and functions.  Names are interned in one table of symbols and
+  whatever a name is bound to hangs off its symbol, so a lookup is one
+  hash and a short chain walk.  An alias keeps its value lexed: tokens
+  are made the first time it is expanded and spliced in from then on.
+  Expansion happens between lexing and parsing, for words where a
+  command name can stand, and only in interactive shells, as elsewhere.
+  A function keeps the text of its body and parses it into an arena of
+  its own on the first call; calls run in the shell, like builtins.
+ */
+#define MSH_SYM_BUCKETS 256   // power of two
+#define MSH_FUNC_DEPTH  100   // nested calls allowed
+
+struct msh_alias {
+   char* value;                 // as defined
+   struct msh_token* tokens;    // value lexed, NULL until first expanded
+   int ntokens;                 // -1 if it does not lex
+   struct msh_arena arena;      // owns value and tokens
+};
+
+struct msh_func {
+   char* body;                  // text between the braces
+   struct msh_pipeline* pipes;  // body parsed, once called
+   int npipes;                  // -1 until parsed, or if it does not parse
+   int calls;                   // calls in progress
+   int replaced;                // redefined while called: free after
+   struct msh_arena arena;      // owns body and pipes
+};
+
+struct msh_sym {
+   struct msh_sym* next;        // hash chain
+   unsigned hash;
+   struct msh_alias* alias;
+   struct msh_func* func;
+   int expanding;               // alias being expanded, not to recurse
+   char* var;                   // NAME=value of a variable, NULL if unset
+   int exported;
+   int inherited;               // var is the inherited environment's own string
+   int envslot;                 // 1 + its index in msh_envp, 0 if not there
+   char name[];
+};
+
+static struct msh_sym* msh_sym_table[MSH_SYM_BUCKETS];
+static int msh_nalias;
+
+/**
+   @brief Find the symbol for a name that need not be terminated.
+   @param name The name.
+   @param len Its length.
+   @param create Nonzero to make a symbol if there is none.
+   @return The symbol, or NULL if there is none and create is 0.
+ */
+static struct msh_sym* msh_sym_getn(const char* name, size_t len, int create)
+{
+   unsigned h = 2166136261u;
+   struct msh_sym** bucket;
+   struct msh_sym* sym;
+   size_t i;
+
+   for (i = 0; i < len; i++) {   // msh_strhash, but over a length
+      h = (h ^ (unsigned char)name[i]) * 16777619u;
+   }
+   bucket = &msh_sym_table[h & (MSH_SYM_BUCKETS - 1)];
+   for (sym = *bucket; sym; sym = sym->next) {
+      if (sym->hash == h && strncmp(sym->name, name, len) == 0 && sym->name[len] == '\0') {
+         return sym;
+      }
+   }
+   if (!create) {
+      return NULL;
+   }
+   sym = calloc(1, sizeof(struct msh_sym) + len + 1);
+   if (!sym) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   memcpy(sym->name, name, len);
+   sym->hash = h;
+   sym->next = *bucket;
+   *bucket = sym;
+   return sym;
+}
+
+/**
+   @brief Find a name's symbol.
+   @param name The name.
+   @param create Nonzero to make a symbol if there is none.
+   @return The symbol, or NULL if there is none and create is 0.
+ */
+static struct msh_sym* msh_sym_get(const char* name, int create)
+{
+   return msh_sym_getn(name, strlen(name), create);
+}
+
+/*
+  Variables.  A variable's NAME=value string is what the environment of
+  launched programs holds, so exporting one is a pointer in msh_envp and
+  nothing is copied.  msh_envp starts as the inherited environment, its
+  strings borrowed, and only changes where an exported variable does:
+  a new value replaces one pointer, an unset one moves the last entry
+  into its place.  environ always points at it, so every spawn backend
+  uses it as it stands, and the fork server is only sent it again after
+  it has changed.  Inherited entries that are not valid names stay in it
+  untouched.
+ */
+char** msh_envp;
+static struct msh_sym** msh_envsyms;   // the variable of each entry, or NULL
+static int msh_envc, msh_envcap;
+static int msh_env_imported;
+
+/**
+   @brief Make room for one more entry in msh_envp.
+ */
+static void msh_env_grow(void)
+{
+   if (msh_envc + 1 >= msh_envcap) {
+      msh_envcap = msh_envcap ? msh_envcap * 2 : 64;
+      msh_envp = realloc(msh_envp, msh_envcap * sizeof(char*));
+      msh_envsyms = realloc(msh_envsyms, msh_envcap * sizeof(struct msh_sym*));
+      if (!msh_envp || !msh_envsyms) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      environ = msh_envp;
+   }
+}
+
+/**
+   @brief Take over the inherited environment: each valid NAME=value in
+   it becomes an exported variable that borrows its string.  Done before
+   the first use of any variable.
+ */
+static void msh_var_import(void)
+{
+   char** e;
+   struct msh_sym* sym;
+   size_t n;
+
+   msh_env_imported = 1;
+   for (e = environ; *e; e++) {
+      n = msh_assign_len(*e);
+      sym = n ? msh_sym_getn(*e, n, 1) : NULL;
+      if (sym && sym->var) {
+         continue;   // a repeated name: the first one is getenv's
+      }
+      msh_env_grow();
+      msh_envp[msh_envc] = *e;
+      msh_envsyms[msh_envc++] = sym;
+      if (sym) {
+         sym->var = *e;
+         sym->exported = sym->inherited = 1;
+         sym->envslot = msh_envc;
+      }
+   }
+   msh_env_grow();
+   msh_envp[msh_envc] = NULL;
+   environ = msh_envp;
+}
+
+/**
+   @brief Import the environment if nothing has yet.
+ */
+static inline void msh_var_init(void)
+{
+   if (!msh_env_imported) {
+      msh_var_import();
+   }
+}
+
+/**
+   @brief Install a variable's string, keeping msh_envp in step.  The old
+   string is the caller's to free, and inherited the caller's to set.
+   @param sym The variable.
+   @param var Its NAME=value, or NULL to unset it.
+   @param exported Whether it is exported.
+ */
+static void msh_var_store(struct msh_sym* sym, char* var, int exported)
+{
+   if (sym->envslot && !(var && exported)) {
+      int k = sym->envslot - 1;
+
+      msh_envp[k] = msh_envp[--msh_envc];
+      msh_envsyms[k] = msh_envsyms[msh_envc];
+      if (msh_envsyms[k]) {
+         msh_envsyms[k]->envslot = k + 1;
+      }
+      msh_envp[msh_envc] = NULL;
+      sym->envslot = 0;
+      msh_env_gen++;
+   }
+   else if (sym->envslot) {
+      msh_envp[sym->envslot - 1] = var;
+      msh_env_gen++;
+   }
+   else if (var && exported) {
+      msh_env_grow();
+      msh_envp[msh_envc] = var;
+      msh_envsyms[msh_envc++] = sym;
+      msh_envp[msh_envc] = NULL;
+      sym->envslot = msh_envc;
+      msh_env_gen++;
+   }
+   sym->var = var;
+   sym->exported = exported;
+   if (strcmp(sym->name, "PATH") == 0) {
+      msh_hash_path_changed();
+   }
+}
+
+/**
+   @brief Value of a variable.
+   @param name The name.
+   @return The value, or NULL if it is unset.
+ */
+const char* msh_var_get(const char* name)
+{
+   return msh_var_getn(name, strlen(name));
+}
+
+/**
+   @brief Value of a variable whose name need not be terminated.
+   @param name The name.
+   @param len Its length.
+   @return The value, or NULL if the variable is unset.
+ */
+const char* msh_var_getn(const char* name, size_t len)
+{
+   struct msh_sym* sym;
+
+   msh_var_init();
+   sym = msh_sym_getn(name, len, 0);
+   return sym && sym->var ? sym->var + len + 1 : NULL;
+}
+
+/**
+   @brief Set a variable from a NAME=value string.
+   @param assign The string; copied.
+   @param export MSH_VAR_EXPORT to export the variable, else MSH_VAR_KEEP.
+   @return 0, or -1 if assign does not start with a valid name.
+ */
+int msh_var_assign(const char* assign, int export)
+{
+   size_t n = msh_assign_len(assign);
+   struct msh_sym* sym;
+   char* old;
+
+   if (n == 0) {
+      return -1;
+   }
+   msh_var_init();
+   sym = msh_sym_getn(assign, n, 1);
+   old = sym->inherited ? NULL : sym->var;
+   msh_var_store(sym, msh_xstrdup(assign), export == MSH_VAR_EXPORT || sym->exported);
+   sym->inherited = 0;
+   free(old);
+   return 0;
+}
+
+/**
+   @brief Set a variable.
+   @param name The name, which must be valid.
+   @param value The value; copied.
+   @param export MSH_VAR_EXPORT to export the variable, else MSH_VAR_KEEP.
+ */
+void msh_var_set(const char* name, const char* value, int export)
+{
+   size_t n = strlen(name), len = strlen(value);
+   char* buf = malloc(n + len + 2);
+
+   if (!buf) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   memcpy(buf, name, n);
+   buf[n] = '=';
+   memcpy(buf + n + 1, value, len + 1);
+   msh_var_assign(buf, export);
+   free(buf);
+}
+
+/**
+   @brief Unset a variable; it is also no longer exported.
+   @param name The name.
+ */
+void msh_var_unset(const char* name)
+{
+   struct msh_sym* sym;
+   char* old;
+
+   msh_var_init();
+   sym = msh_sym_get(name, 0);
+   if (sym && (sym->var || sym->exported)) {
+      old = sym->inherited ? NULL : sym->var;
+      msh_var_store(sym, NULL, 0);
+      sym->inherited = 0;
+      free(old);
+   }
+}
+
+/**
+   @brief Apply a command's assignments for the time it runs.
+   @param cmd The command.
+   @return What they replace, for msh_var_pop: malloc'd, or NULL when
+   there are none.
+ */
+struct msh_var_saved* msh_var_push(struct msh_cmd* cmd)
+{
+   struct msh_var_saved* saved;
+   int i;
+
+   if (cmd->nassigns == 0) {
+      return NULL;
+   }
+   saved = malloc(cmd->nassigns * sizeof(struct msh_var_saved));
+   if (!saved) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   msh_var_init();
+   for (i = 0; i < cmd->nassigns; i++) {
+      struct msh_sym* sym = msh_sym_getn(cmd->assigns[i], msh_assign_len(cmd->assigns[i]), 1);
+
+      saved[i].sym = sym;
+      saved[i].var = sym->var;
+      saved[i].exported = sym->exported;
+      saved[i].inherited = sym->inherited;
+      msh_var_store(sym, msh_xstrdup(cmd->assigns[i]), 1);
+      sym->inherited = 0;
+   }
+   return saved;
+}
+
+/**
+   @brief Undo msh_var_push, last assignment first.
+   @param cmd The command.
+   @param saved What msh_var_push returned; freed.
+ */
+void msh_var_pop(struct msh_cmd* cmd, struct msh_var_saved* saved)
+{
+   int i;
+
+   for (i = cmd->nassigns - 1; i >= 0; i--) {
+      char* tmp = saved[i].sym->var;
+
+      msh_var_store(saved[i].sym, saved[i].var, saved[i].exported);
+      saved[i].sym->inherited = saved[i].inherited;
+      free(tmp);
+   }
+   free(saved);
+}
+
+/**
+   @brief Bind or rebind an alias.  The parse cache is emptied, since
+   lines in it may have been expanded with the old value.
+   @param name The alias.
+   @param value What it expands to.
+ */
+void msh_alias_define(const char* name, const char* value)
+{
+   struct msh_sym* sym = msh_sym_get(name, 1);
+   struct msh_alias* a = calloc(1, sizeof(struct msh_alias));
+
+   if (!a) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   a->value = msh_arena_strndup(&a->arena, value, strlen(value));
+   // The old value is not freed: pipelines already parsed from this
+   // line may hold its tokens and have yet to run.
+   msh_nalias += sym->alias == NULL;
+   sym->alias = a;
+   msh_pcache_clear();
+}
+
+/**
+   @brief Append a token to an expanded token list.
+   @param list The list, in arena memory; may move.
+   @param n Tokens in it.
+   @param cap Room in it.
+   @param t The token.
+   @param arena The list's arena.
+ */
+static void msh_alias_emit(struct msh_token** list, int* n, int* cap,
+                           const struct msh_token* t, struct msh_arena* arena)
+{
+   if (*n == *cap) {
+      struct msh_token* old = *list;
+
+      *cap *= 2;
+      *list = msh_arena_alloc(arena, *cap * sizeof(struct msh_token));
+      memcpy(*list, old, *n * sizeof(struct msh_token));
+   }
+   (*list)[(*n)++] = *t;
+}
+
+/**
+   @brief Copy tokens to a list, expanding aliases in command position.
+   @param list The list being built.
+   @param n Tokens in it.
+   @param cap Room in it.
+   @param tokens Tokens to copy, up to MSH_TOK_END, which is not copied.
+   @param span Token whose place in the line expanded tokens take, or
+   NULL to keep the tokens' own.
+   @param cmdpos In: whether the first token is in command position.
+   Out: whether the next one would be.
+   @param arena Arena for the list.
+ */
+static void msh_alias_copy(struct msh_token** list, int* n, int* cap,
+                           struct msh_token* tokens, const struct msh_token* span,
+                           int* cmdpos, struct msh_arena* arena)
+{
+   struct msh_token* t;
+
+   for (t = tokens; t->type != MSH_TOK_END; t++) {
+      struct msh_sym* sym = NULL;
+      struct msh_token copy = *t;
+
+      if (span) {
+         // error messages and job text show what was typed
+         copy.start = span->start;
+         copy.end = span->end;
+      }
+      if (*cmdpos && t->type == MSH_TOK_WORD && msh_tok_plain(t)) {
+         sym = msh_sym_get(t->text, 0);
+      }
+      if (sym && sym->alias && !sym->expanding) {
+         struct msh_alias* a = sym->alias;
+
+         if (!a->tokens && a->ntokens == 0) {
+            char* text = msh_arena_strndup(&a->arena, a->value, strlen(a->value));
+
+            a->tokens = msh_lex(text, &a->arena);
+            while (a->tokens && a->tokens[a->ntokens].type != MSH_TOK_END) {
+               a->ntokens++;
+            }
+            if (!a->tokens) {
+               a->ntokens = -1;
+            }
+         }
+         if (a->tokens) {
+            sym->expanding = 1;
+            msh_alias_copy(list, n, cap, a->tokens, span ? span : t, cmdpos, arena);
+            sym->expanding = 0;
+            continue;
+         }
+      }
+      msh_alias_emit(list, n, cap, &copy, arena);
+      if (t->type == MSH_TOK_WORD) {
+         // prefixes and assignments leave the command name still to come
+         *cmdpos = *cmdpos && (t->assign ||
+                               (msh_tok_plain(t) && (strcmp(t->text, "time") == 0 ||
+                                                     strcmp(t->text, "with") == 0 ||
+                                                     strcmp(t->text, "--") == 0)));
+      }
+      else {
+         *cmdpos = t->type == MSH_TOK_PIPE || t->type == MSH_TOK_AMP ||
+                   t->type == MSH_TOK_SEMI || t->type == MSH_TOK_AND ||
+                   t->type == MSH_TOK_OR;
+      }
+   }
+}
+
+/**
+   @brief Expand aliases in a line's tokens.
+   @param tokens Tokens from msh_lex.
+   @param arena Arena for the expanded list.
+   @return The tokens, or a new list when something was expanded.
+ */
+struct msh_token* msh_alias_expand(struct msh_token* tokens, struct msh_arena* arena)
+{
+   struct msh_token* list;
+   struct msh_token* t;
+   int n = 0, cap = MSH_TOK_BUFSIZE, cmdpos = 1;
+
+   if (msh_nalias == 0 || !msh_interactive) {
+      return tokens;
+   }
+   for (t = tokens; t->type != MSH_TOK_END; t++)
+      ;
+   list = msh_arena_alloc(arena, cap * sizeof(struct msh_token));
+   msh_alias_copy(&list, &n, &cap, tokens, NULL, &cmdpos, arena);
+   msh_alias_emit(&list, &n, &cap, t, arena);
+   return list;
+}
+
+/**
+   @brief qsort comparison of symbols by name.
+ */
+static int msh_sym_cmp(const void* a, const void* b)
+{
+   return strcmp((*(struct msh_sym* const*)a)->name, (*(struct msh_sym* const*)b)->name);
+}
+
+/**
+   @brief Builtin command: define or show aliases.
+   @param args List of args.  args[0] is "alias".  Each name=value
+   defines an alias, and each plain name shows one; without any, all of
+   them are shown.
+   @return Always returns 1, to continue executing.
+ */
+int msh_alias(char** args)
+{
+   struct msh_sym* sym;
+   char* eq;
+   int i, k, n = 0;
+
+   if (args[1] == NULL) {
+      struct msh_sym** all = malloc((msh_nalias + 1) * sizeof(struct msh_sym*));
+
+      if (!all) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      for (k = 0; k < MSH_SYM_BUCKETS; k++) {
+         for (sym = msh_sym_table[k]; sym; sym = sym->next) {
+            if (sym->alias) {
+               all[n++] = sym;
+            }
+         }
+      }
+      qsort(all, n, sizeof(struct msh_sym*), msh_sym_cmp);
+      for (k = 0; k < n; k++) {
+         msh_obuf_printf(&msh_out, "alias %s='%s'\n", all[k]->name, all[k]->alias->value);
+      }
+      free(all);
+      return 1;
+   }
+   for (i = 1; args[i] != NULL; i++) {
+      eq = strchr(args[i], '=');
+      if (eq == args[i]) {
+         fprintf(stderr, "msh: alias: %s: invalid alias name\n", args[i]);
+         msh_builtin_status = 1;
+      }
+      else if (eq) {
+         *eq = '\0';   // the word is this line's to modify
+         if (strpbrk(args[i], " \t|&;<>'\"\\")) {
+            fprintf(stderr, "msh: alias: %s: invalid alias name\n", args[i]);
+            msh_builtin_status = 1;
+         }
+         else {
+            msh_alias_define(args[i], eq + 1);
+         }
+         *eq = '=';
+      }
+      else if ((sym = msh_sym_get(args[i], 0)) && sym->alias) {
+         msh_obuf_printf(&msh_out, "alias %s='%s'\n", sym->name, sym->alias->value);
+      }
+      else {
+         fprintf(stderr, "msh: alias: %s: not found\n", args[i]);
+         msh_builtin_status = 1;
+      }
+   }
+   return 1;
+}
+
+/**
+   @brief Builtin command: remove aliases.
+   @param args List of args.  args[0] is "unalias".  Each further arg is
+   an alias to remove, or -a to remove them all.
+   @return Always returns 1, to continue executing.
+ */
+int msh_unalias(char** args)
+{
+   struct msh_sym* sym;
+   int i, k;
+
+   for (i = 1; args[i] != NULL; i++) {
+      if (strcmp(args[i], "-a") == 0) {
+         for (k = 0; k < MSH_SYM_BUCKETS; k++) {
+            for (sym = msh_sym_table[k]; sym; sym = sym->next) {
+               sym->alias = NULL;
+            }
+         }
+         msh_nalias = 0;
+      }
+      else if ((sym = msh_sym_get(args[i], 0)) && sym->alias) {
+         sym->alias = NULL;   // not freed, as in msh_alias_define
+         msh_nalias--;
+      }
+      else {
+         fprintf(stderr, "msh: unalias: %s: not found\n", args[i]);
+         msh_builtin_status = 1;
+      }
+   }
+   msh_pcache_clear();
+   return 1;
+}
+
+/**
+   @brief Free a function that is no longer bound or called.
+   @param f The function.
+ */
+static void msh_func_free(struct msh_func* f)
+{
+   msh_arena_reset(&f->arena);
+   free(f->arena.head);
+   free(f);
+}
+
+/**
+   @brief Drop a function binding; the function goes once no call of it
+   is running.
+   @param sym Its symbol.
+ */
+static void msh_func_unbind(struct msh_sym* sym)
+{
+   struct msh_func* f = sym->func;
+
+   sym->func = NULL;
+   if (f && f->calls > 0) {
+      f->replaced = 1;
+   }
+   else if (f) {
+      msh_func_free(f);
+   }
+}
+
+/**
+   @brief Bind or rebind a function.
+   @param name The function.
+   @param body Its body, the text between the braces.
+ */
+void msh_func_define(const char* name, const char* body)
+{
+   struct msh_sym* sym = msh_sym_get(name, 1);
+   struct msh_func* f = calloc(1, sizeof(struct msh_func));
+
+   if (!f) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   f->body = msh_arena_strndup(&f->arena, body, strlen(body));
+   f->npipes = -1;
+   msh_func_unbind(sym);
+   sym->func = f;
+}
+
+/**
+   @brief Run a function, in the shell.  Reached through msh_func_builtin,
+   so that redirections, pipelines and time treat calls like builtins.
+   @param args List of args.  args[0] is the function.  The rest are its
+   positional parameters while the body runs.
+   @return 0 if the body ran exit, else 1.
+ */
+static int msh_func_call(char** args)
+{
+   static int depth;
+   struct msh_sym* sym = msh_sym_get(args[0], 0);
+   struct msh_func* f = sym ? sym->func : NULL;
+   char** saved_argv = msh_argv;
+   int saved_argc = msh_argc;
+   int status;
+
+   if (!f) {
+      return 1;   // unset by the time it ran
+   }
+   if (depth == MSH_FUNC_DEPTH) {
+      fprintf(stderr, "msh: %s: maximum function nesting exceeded\n", args[0]);
+      msh_builtin_status = 1;
+      return 1;
+   }
+   if (!f->pipes && f->npipes < 0) {
+      char* text = msh_arena_strndup(&f->arena, f->body, strlen(f->body));
+
+      f->pipes = msh_parse_line(text, &f->arena, &f->npipes);
+      if (f->npipes < 0) {
+         msh_builtin_status = 2;
+         return 1;   // reported, and again on later calls
+      }
+   }
+
+   f->calls++;
+   depth++;
+   msh_argv = args + 1;
+   for (msh_argc = 0; msh_argv[msh_argc]; msh_argc++)
+      ;
+   status = msh_run_list(f->pipes, f->npipes);
+   msh_builtin_status = msh_last.status;
+   msh_argv = saved_argv;
+   msh_argc = saved_argc;
+   depth--;
+   if (--f->calls == 0 && f->replaced) {
+      msh_func_free(f);
+   }
+   return status;
+}
+
+static const struct msh_builtin msh_func_builtin = { "function", &msh_func_call };
+
+/**
+   @brief Look up what a name runs in the shell: a builtin, or failing
+   that a function.
+   @param name The command name.
+   @return The builtin, msh_func_builtin for a function, or NULL.
+ */
+const struct msh_builtin* msh_find_command(const char* name)
+{
+   const struct msh_builtin* b = msh_find_builtin(name);
+   struct msh_sym* sym;
+
+   if (b) {
+      return b;
+   }
+   sym = msh_sym_get(name, 0);
+   return sym && sym->func ? &msh_func_builtin : NULL;
+}
+
+/**
+   @brief Builtin command: remove variables or functions.
+   @param args List of args.  args[0] is "unset".  After -f each later
+   arg is a function to remove; otherwise, or after -v, a variable.
+   @return Always returns 1, to continue executing.
+ */
+int msh_unset(char** args)
+{
+   struct msh_sym* sym;
+   int i = 1, funcs = 0;
+
+   if (args[1] && (strcmp(args[1], "-f") == 0 || strcmp(args[1], "-v") == 0)) {
+      funcs = args[1][1] == 'f';
+      i++;
+   }
+   for (; args[i] != NULL; i++) {
+      if (!funcs) {
+         msh_var_unset(args[i]);
+      }
+      else if ((sym = msh_sym_get(args[i], 0))) {
+         msh_func_unbind(sym);
+      }
+   }
+   return 1;
+}
+
+/**
+   @brief Builtin command: export variables.
+   @param args List of args.  args[0] is "export".  Each NAME=value sets
+   and exports a variable, and each plain name exports one; without any,
+   the exported variables are shown.
+   @return Always returns 1, to continue executing.
+ */
+int msh_export(char** args)
+{
+   struct msh_sym* sym;
+   int i, k, n = 0;
+
+   if (args[1] == NULL) {
+      struct msh_sym** all;
+
+      msh_var_init();
+      all = malloc((msh_envc + 1) * sizeof(struct msh_sym*));
+      if (!all) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      for (k = 0; k < msh_envc; k++) {
+         if (msh_envsyms[k]) {
+            all[n++] = msh_envsyms[k];
+         }
+      }
+      qsort(all, n, sizeof(struct msh_sym*), msh_sym_cmp);
+      for (k = 0; k < n; k++) {
+         msh_obuf_printf(&msh_out, "export %s='%s'\n", all[k]->name,
+                         all[k]->var + strlen(all[k]->name) + 1);
+      }
+      free(all);
+      return 1;
+   }
+   for (i = 1; args[i] != NULL; i++) {
+      if (strchr(args[i], '=')) {
+         if (msh_var_assign(args[i], MSH_VAR_EXPORT) < 0) {
+            fprintf(stderr, "msh: export: %s: not a valid identifier\n", args[i]);
+            msh_builtin_status = 1;
+         }
+      }
+      else if (args[i][msh_name_len(args[i])] != '\0' || args[i][0] == '\0') {
+         fprintf(stderr, "msh: export: %s: not a valid identifier\n", args[i]);
+         msh_builtin_status = 1;
+      }
+      else {
+         msh_var_init();
+         sym = msh_sym_get(args[i], 1);
+         msh_var_store(sym, sym->var, 1);
+      }
+   }
+   return 1;
+}
+
+/**
+   @brief Builtin command: drop positional parameters, so that $2 becomes
+   $1 and so on.
+   @param args List of args.  args[0] is "shift".  args[1], if given, is
+   how many to drop, 1 by default.
+   @return Always returns 1, to continue executing.
+ */
+int msh_shift(char** args)
+{
+   char* end;
+   long n = 1;
+
+   if (args[1]) {
+      n = strtol(args[1], &end, 10);
+      if (*args[1] == '\0' || *end != '\0' || n < 0) {
+         fprintf(stderr, "msh: shift: %s: numeric argument required\n", args[1]);
+         msh_builtin_status = 2;
+         return 1;
+      }
+   }
+   if (n > msh_argc) {
+      msh_builtin_status = 1;   // nothing is dropped, as in sh
+      return 1;
+   }
+   msh_argv += n;
+   msh_argc -= n;
+   return 1;
+}
+
+/**
+   @brief Print shell statistics: the parse cache, and with MSH_STATS the
+   per-phase counters.
+   @param o Where to print.
+ */
+void msh_stats_print(struct msh_obuf* o)
+{
+   int i, n = 0;
+
+   for (i = 0; i < MSH_PCACHE_SIZE; i++) {
+      n += msh_pcache[i].key != NULL;
+   }
+   msh_obuf_printf(o, "parse cache: %lu hits, %lu misses, %d/%d entries\n",
+           msh_pcache_hits, msh_pcache_misses, n, MSH_PCACHE_SIZE);
+#ifdef MSH_STATS
+   msh_obuf_printf(o, "%-10s %10s %14s %12s\n", "phase", "calls", "total us",
+                   "avg ns");
+   for (i = 0; i < MSH_ST_COUNT; i++) {
+      struct msh_stat* st = &msh_stat_table[i];
+
+      msh_obuf_printf(o, "%-10s %10lu %14.1f %12llu\n", st->name, st->calls,
+                      st->ns / 1e3, st->calls ? st->ns / st->calls : 0);
+   }
+#endif
+}
+
+pid_t msh_stats_pid;   // the shell that asked for a dump on exit
+
+/**
+   @brief atexit handler for --stats.  Forked children that exit through
+   exit() keep quiet.
+ */
+void msh_stats_dump(void)
+{
+   static struct msh_obuf err = { STDERR_FILENO };
+
+   if (getpid() == msh_stats_pid) {
+      msh_obuf_flush(&msh_out);
+      msh_stats_print(&err);
+      msh_obuf_flush(&err);
+   }
+}
+
+/**
+   @brief Builtin command: print shell statistics.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int msh_stats(char** args)
+{
+   msh_stats_print(&msh_out);
+   return 1;
+}
 
-/*
-  Function Declarations for builtin shell commands:
+/**
+   @brief Parse a line and execute its pipelines in order.
+   @param line The line.  Modified in place.
+   @param arena Arena for everything parsed from the line.
+   @return 1 if the shell should continue running, 0 if it should terminate
  */
-int msh_cd(char** args);
-int msh_help(char** args);
-int msh_exit(char** args);
-int msh_pwd(char** args);
+int msh_run_line(char* line, struct msh_arena* arena)
+{
+   struct msh_pipeline* pipes;
+   struct msh_pcache_entry* entry;
+   int npipes, status;
+
+   pipes = msh_parse_cached(line, arena, &npipes, &entry);
+   status = msh_run_list(pipes, npipes);
+   msh_pcache_unpin(entry);
+   return status;
+}
 
 /*
-  List of builtin commands, followed by their corresponding functions.
+  Script mode.  The whole script is mapped (or read) in one go, every
+  line is parsed before anything runs, and then the parsed lines are
+  executed.  A syntax error anywhere means nothing is run at all.
  */
-char* builtin_str[] = {
-        "cd",
-        "help",
-        "exit",
-        "pwd"
+struct msh_script_line {
+   struct msh_pipeline* pipes;
+   int npipes;
 };
 
-int (*builtin_func[]) (char**) = {
-        &msh_cd,
-        &msh_help,
-        &msh_exit,
-        &msh_pwd
-};
+/**
+   @brief Parse and run a whole script.
+   @param text The script.  Modified in place.
+   @param len Its length.
+   @param name Script name, for error messages.
+   @return Exit status for the shell.
+ */
+int msh_run_script(char* text, size_t len, const char* name)
+{
+   struct msh_arena arena = { NULL };
+   struct msh_script_line* lines;
+   char* end = text + len;
+   char* p;
+   char* nl;
+   char* line;
+   int nlines = 0, i, status = 1;
 
-int msh_num_builtins() {
-   return sizeof(builtin_str) / sizeof(char*);
-}
+   for (p = text; p < end && (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+      nlines++;
+   }
+   nlines++;
+   lines = msh_arena_alloc(&arena, nlines * sizeof(struct msh_script_line));
 
-/*
-  Builtin function implementations.
-*/
+   msh_src_name = name;
+   for (p = text, i = 0; i < nlines; i++, p = nl + 1) {
+      nl = p < end ? memchr(p, '\n', end - p) : NULL;
+      if (nl) {
+         *nl = '\0';
+         line = p;
+      }
+      else {
+         // the last line may have no newline to overwrite
+         line = msh_arena_strndup(&arena, p, p < end ? end - p : 0);
+         nl = end;
+      }
+      msh_src_line = i + 1;
+      lines[i].pipes = msh_parse_line(line, &arena, &lines[i].npipes);
+      if (lines[i].npipes < 0) {
+         return 2;
+      }
+   }
+
+   for (i = 0; status && i < nlines; i++) {
+      msh_src_line = i + 1;
+      status = msh_run_list(lines[i].pipes, lines[i].npipes);
+      msh_job_notify();
+   }
+   return msh_last.status;
+}
 
-#define MSH_DIRECT_MAX 260
 /**
-   @brief Built-in command: prints the current working directory
-   @param args list of args. args[0] is "pwd"
-   @return Always returns 1, to continue executing.
-*/
-int msh_pwd(char** args)
+   @brief Run a script file.  Regular files are mapped copy-on-write so
+   the lexer can work in place; anything else is read in one go.
+   @param path The script.
+   @return Exit status for the shell.
+ */
+int msh_run_file(const char* path)
 {
-   char cwd[MSH_DIRECT_MAX];
-   if (getcwd(cwd, sizeof(cwd)) != NULL) {
-      printf("Current working dir: %s\n", cwd);
+   struct stat st;
+   char* text = NULL;
+   size_t len = 0, cap = 0;
+   ssize_t n;
+   int fd;
+
+   fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0 || fstat(fd, &st) < 0) {
+      fprintf(stderr, "msh: %s: %s\n", path, strerror(errno));
+      return MSH_EXEC_FAILED;
    }
-   else {
-      perror("cwd error");
+   if (S_ISREG(st.st_mode) && st.st_size > 0) {
+      len = st.st_size;
+      text = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (text != MAP_FAILED) {
+         close(fd);
+         return msh_run_script(text, len, path);
+      }
+      text = NULL;
+      len = 0;
    }
-   return 1;
+
+   while (1) {
+      if (len == cap) {
+         cap = cap ? cap * 2 : MSH_RD_BLOCKSIZE;
+         text = realloc(text, cap);
+         if (!text) {
+            fprintf(stderr, "msh: allocation error\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+      n = read(fd, text + len, cap - len);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n < 0) {
+         fprintf(stderr, "msh: %s: %s\n", path, strerror(errno));
+         return EXIT_FAILURE;
+      }
+      if (n == 0) {
+         break;
+      }
+      len += n;
+   }
+   close(fd);
+   return msh_run_script(text, len, path);
 }
 
+/*
+  Startup file.  An interactive shell maps ~/.mshrc at startup and does
+  nothing else with it.  The first command line scans it, a memchr per
+  line, and gives each definition its meaning: set, alias and export
+  lines, variable assignments and functions, applied by that scan in
+  file order, since the command that triggered it may depend on them.
+  Script and -c shells never read the file.
+ */
+#define MSH_RC_FILE ".mshrc"   // in $HOME
+
+static char* msh_rc_map;   // copy-on-write, so lines are parsed in place
+static size_t msh_rc_size;
+static char* msh_rc_name;
+
 /**
-   @brief Built-in command: change directory.
-   @param args List of args.  args[0] is "cd".  args[1] is the directory.
-   @return Always returns 1, to continue executing.
+   @brief Map the startup file, if there is one.
  */
-int msh_cd(char** args)
+void msh_rc_open(void)
 {
-   if (args[1] == NULL) {
-      fprintf(stderr, "msh: expected argument to \"cd\"\n");
+   const char* home = msh_var_get("HOME");
+   struct stat st;
+   int fd;
+
+   if (!home || !*home) {
+      return;
    }
-   else {
-      if (chdir(args[1]) != 0) {
-         perror("msh");
+   msh_rc_name = malloc(strlen(home) + sizeof(MSH_RC_FILE) + 1);
+   if (!msh_rc_name) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   sprintf(msh_rc_name, "%s/%s", home, MSH_RC_FILE);
+   fd = open(msh_rc_name, O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      return;
+   }
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      msh_rc_map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (msh_rc_map == MAP_FAILED) {
+         fprintf(stderr, "msh: %s: %s\n", msh_rc_name, strerror(errno));
+         msh_rc_map = NULL;
+      }
+      else {
+         msh_rc_size = st.st_size;
       }
    }
-   return 1;
+   close(fd);
 }
 
 /**
-   @brief Builtin command: print help.
-   @param args List of args.  Not examined.
-   @return Always returns 1, to continue executing.
+   @brief Go through the startup file, the first time this is called.
+   Blank lines and # comments are skipped; anything that is not a
+   definition is reported and ignored.
  */
-int msh_help(char** args)
+void msh_rc_scan(void)
 {
-   int i;
-   printf("Group 11's MSH\n");
-   printf("Type program names and arguments, and hit enter.\n");
-   printf("The following are built in:\n");
+   struct msh_arena arena = { NULL };
+   const char* saved_name = msh_src_name;
+   int saved_line = msh_src_line;
+   char* end = msh_rc_map + msh_rc_size;
+   char* p;
+   char* nl;
+   int lineno = 0;
 
-   for (i = 0; i < msh_num_builtins(); i++) {
-      printf("  %s\n", builtin_str[i]);
+   if (!msh_rc_map) {
+      return;
    }
+   msh_src_name = msh_rc_name;
+   for (p = msh_rc_map; p < end; p = nl + 1) {
+      struct msh_pipeline* pl;
+      char** args;
+      char* line;
+      int npipes;
 
-   printf("Use the man command for information on other programs.\n");
-   return 1;
+      nl = memchr(p, '\n', end - p);
+      if (nl) {
+         *nl = '\0';
+         line = p;
+      }
+      else {
+         line = msh_arena_strndup(&arena, p, end - p);
+         nl = end;
+      }
+      msh_src_line = ++lineno;
+      line += strspn(line, " \t");
+      if (*line == '\0' || *line == '#') {
+         continue;
+      }
+      pl = msh_parse_line(line, &arena, &npipes);
+      args = pl && pl->ncmds == 1 && !pl->background ? pl->cmds[0].argv : NULL;
+      if (npipes == 1 && (pl->fname ||
+                          (args && args[0] == NULL && pl->cmds[0].nassigns > 0 &&
+                           pl->cmds[0].nredirs == 0) ||
+                          (args && args[0] && pl->cmds[0].nassigns == 0 &&
+                           (strcmp(args[0], "set") == 0 || strcmp(args[0], "alias") == 0 ||
+                            strcmp(args[0], "export") == 0)))) {
+         msh_execute(pl, &msh_last);
+      }
+      else if (npipes >= 0) {
+         fprintf(stderr, "msh: %s: line %d: not a definition\n", msh_rc_name, lineno);
+      }
+      msh_arena_reset(&arena);
+   }
+   munmap(msh_rc_map, msh_rc_size);
+   msh_rc_map = NULL;
+   free(arena.head);
+   msh_src_name = saved_name;
+   msh_src_line = saved_line;
 }
 
 /**
-   @brief Builtin command: exit.
-   @param args List of args.  Not examined.
-   @return Always returns 0, to terminate execution.
+   @brief Join words with single spaces, for messages.
+   @param words Null terminated list of words.
+   @param arena Arena for the result.
+   @return The joined text.
  */
-int msh_exit(char** args)
+char* msh_join_words(char** words, struct msh_arena* arena)
 {
-   return 0;
+   size_t len = 0;
+   char* text;
+   char* p;
+   int i;
+
+   for (i = 0; words[i] != NULL; i++) {
+      len += strlen(words[i]) + 1;
+   }
+   p = text = msh_arena_alloc(arena, len + 1);
+   for (i = 0; words[i] != NULL; i++) {
+      if (i > 0) {
+         *p++ = ' ';
+      }
+      len = strlen(words[i]);
+      memcpy(p, words[i], len);
+      p += len;
+   }
+   *p = '\0';
+   return text;
 }
 
 /**
-  @brief Launch a program and wait for it to terminate.
-  @param args Null terminated list of arguments (including program).
-  @return Always returns 1, to continue execution.
+   @brief Reap finished parallel jobs and report their exit status.
+   Call with SIGCHLD blocked.
+   @param slots Jobs in flight; finished ones are set to NULL.
+   @param nslots Size of slots.
+   @param failed Incremented for each job that did not exit 0.
+   @return Number of jobs still in flight.
  */
-int msh_pipe(char** args) {
-   int fd[2];
-   pid_t pid1;
-   pid_t pid2;
-   int pipeLoc = -1;                // where the pipe is located
-   char inputArgs[1024] = {'\n'};   // first set of args
-   char inputArgsV[1024] = {'\n'};  // additional args
-   char outputArgs[1024] = {'\n'};  // second set of args
-   char outputArgsV[1024] = {'\n'}; // additional args
-
+static int msh_parallel_reap(struct msh_job** slots, int nslots, int* failed)
+{
+   struct msh_job* job;
+   int i, status, running = 0;
 
-   strcpy(inputArgs, args[0]);   // set initial value of input args
-   for (int i = 1; args[i] != NULL && strcmp(args[i], "|") != 0; i++)
-   {
-      if (strcmp(inputArgsV, "\n") == 0)
-      {
-         strcpy(inputArgsV, args[i]);  // need to use strcpy for empty input
+   for (i = 0; i < nslots; i++) {
+      job = slots[i];
+      if (!job) {
+         continue;
       }
-      else
-      {
-         strcat(inputArgsV, " ");
-         strcat(inputArgsV, args[i]);
+      if (msh_job_state(job) != MSH_PROC_DONE) {
+         running++;
+         continue;
       }
-   }
-
-
-   // find the location of the pipe
-   for (int i = 1; args[i] != NULL; i++)
-   {
-      if (strcmp(args[i], "|") == 0)
-      {
-         pipeLoc = i;
+      status = job->procs[job->nprocs - 1].status;
+      if (WIFSIGNALED(status)) {
+         fprintf(stderr, "parallel: [%d] signal %d\t%s\n", job->id,
+                 WTERMSIG(status), job->cmd);
+      }
+      else {
+         fprintf(stderr, "parallel: [%d] exit %d\t%s\n", job->id,
+                 WEXITSTATUS(status), job->cmd);
+      }
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+         (*failed)++;
       }
+      msh_job_free(job);
+      slots[i] = NULL;
    }
-   pipeLoc++;  // set starting value for outputArgs
+   return running;
+}
 
+/**
+   @brief Builtin command: run command lines concurrently.
+   @param args List of args.  args[0] is "parallel".  "-j N" limits the
+   number of jobs in flight (default: online CPUs).  If a command
+   follows, each input line is appended to it as one more argument;
+   otherwise each input line is a command line of its own.  Input lines
+   come from stdin, or from the args after ":::".  The status is 1 if
+   any job failed or any line could not be run.
+   @return Always returns 1, to continue executing.
+ */
+int msh_parallel(char** args)
+{
+   struct msh_arena arena = { NULL };
+   struct msh_job** slots;
+   struct msh_pipeline* pl;
+   struct msh_pcache_entry* entry = NULL;
+   struct msh_cmd one;
+   const struct msh_attrs* with = msh_with;
+   struct msh_attrs* pinned = NULL;
+   char** command;
+   char** inputs = NULL;
+   char** argv;
+   char* line;
+   size_t len;
+   sigset_t old;
+   int njobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   int ncommand, npipes;
+   int i, running = 0, failed = 0;
 
-   strcpy(outputArgs, args[pipeLoc]);  // set initial value of output args
-   for (int i = pipeLoc + 1; args[i] != NULL; i++)
-   {
-      if (strcmp(outputArgsV, "\n") == 0)
-      {
-         strcpy(outputArgsV, args[i]); // need to use strcpy for empty input
+   for (i = 1; args[i] != NULL && args[i][0] == '-'; i++) {
+      if (strcmp(args[i], "--") == 0) {
+         i++;
+         break;
+      }
+      else if (strncmp(args[i], "-j", 2) == 0) {
+         const char* n = args[i][2] ? args[i] + 2 : args[++i];
+         if (n == NULL || (njobs = atoi(n)) <= 0) {
+            fprintf(stderr, "msh: parallel: -j expects a positive number\n");
+            msh_builtin_status = 2;
+            return 1;
+         }
+      }
+      else {
+         fprintf(stderr, "msh: parallel: %s: unknown option\n", args[i]);
+         msh_builtin_status = 2;
+         return 1;
       }
-      else
-      {
-         strcat(outputArgsV, " ");
-         strcat(outputArgsV, args[i]);
+   }
+   if (njobs <= 0) {
+      njobs = 1;
+   }
+   // args may be a cached parse, used again: copy the command out of it
+   // rather than cut it off at the :::
+   for (ncommand = 0; args[i + ncommand] != NULL; ncommand++) {
+      if (strcmp(args[i + ncommand], ":::") == 0) {
+         inputs = &args[i + ncommand + 1];
+         break;
       }
    }
+   command = malloc((ncommand + 1) * sizeof(char*));
+   if (!command) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   memcpy(command, &args[i], ncommand * sizeof(char*));
+   command[ncommand] = NULL;
 
-   
-   // executing pipe command
-   if (pipe(fd))
-   {
-      perror("Pipe error\n");
-      return 0;
+   slots = calloc(njobs, sizeof(struct msh_job*));
+   if (!slots) {
+      fprintf(stderr, "msh: allocation error\n");
+      exit(EXIT_FAILURE);
    }
-   pid1 = fork();
+   if (with && (with->set & MSH_ATTR_CPUS)) {
+      // Under "with cpus=...", slot i keeps to the i-th CPU of the set
+      // (wrapping around), so jobs do not migrate across each other.
+      int ncpus = CPU_COUNT(&with->cpus), cpu = -1, k;
 
-   if (pid1 == 0)
-   {
-      close(fd[1]);
-      dup2(fd[0], STDIN_FILENO);
-      close(fd[0]);
-      if (strcmp(outputArgsV, "\n") == 0)
-      {
-         execlp(outputArgs, outputArgs, NULL);  // execute without additional args
+      pinned = malloc(njobs * sizeof(struct msh_attrs));
+      if (!pinned) {
+         fprintf(stderr, "msh: allocation error\n");
+         exit(EXIT_FAILURE);
       }
-      else
-      {
-         execlp(outputArgs, outputArgs, outputArgsV, NULL);
+      for (i = 0; i < njobs; i++) {
+         k = i % ncpus == 0 ? -1 : cpu;
+         do {
+            k++;
+         } while (!CPU_ISSET(k, &with->cpus));
+         cpu = k;
+         pinned[i] = *with;
+         CPU_ZERO(&pinned[i].cpus);
+         CPU_SET(cpu, &pinned[i].cpus);
       }
-      //execlp("/bin/sh", "/bin/sh", "-c", convertedArgs, NULL);  // cheatsy method
-      //execlp("wc", "wc", "-l", NULL);
-      //execlp("grep", "grep", "main", NULL);   // executes grep main
    }
-   else
-   {
-      pid2 = fork();
 
-      if (pid2 == 0)
-      {
-         close(fd[0]);
-         dup2(fd[1], STDOUT_FILENO);
-         close(fd[1]);
-         if (strcmp(inputArgsV, "\n") == 0)
-         {
-            execlp(inputArgs, inputArgs, NULL); // execute without additional args
+   while (1) {
+      if (inputs) {
+         line = *inputs ? *inputs++ : NULL;
+         len = line ? strlen(line) : 0;
+      }
+      else {
+         line = msh_input_getline(&len);
+      }
+      if (line == NULL) {
+         break;
+      }
+      if (len == 0) {
+         continue;
+      }
+
+      // wait for a free slot
+      msh_block_sigchld(&old);
+      while ((running = msh_parallel_reap(slots, njobs, &failed)) >= njobs) {
+         sigsuspend(&old);
+      }
+
+      msh_arena_reset(&arena);
+      line = msh_arena_strndup(&arena, line, len);
+      if (ncommand > 0) {
+         argv = msh_arena_alloc(&arena, (ncommand + 2) * sizeof(char*));
+         memcpy(argv, command, ncommand * sizeof(char*));
+         argv[ncommand] = line;
+         argv[ncommand + 1] = NULL;
+         one.argv = argv;
+         one.nredirs = 0;
+         one.nassigns = 0;
+         one.expand = 0;
+         one.attrs = NULL;
+         one.with = NULL;
+         pl = msh_arena_alloc(&arena, sizeof(struct msh_pipeline));
+         pl->cmds = &one;
+         pl->ncmds = 1;
+         pl->text = msh_join_words(argv, &arena);
+         npipes = 1;
+      }
+      else {
+         pl = msh_parse_cached(line, &arena, &npipes, &entry);
+         if (pl && npipes != 1) {
+            fprintf(stderr, "msh: parallel: %s: expected a single pipeline\n",
+                    pl->text);
+            pl = NULL;
+            failed++;
+         }
+         else if (npipes < 0) {
+            failed++;   // the syntax error is already printed
          }
-         else
-         {
-            execlp(inputArgs, inputArgs, inputArgsV, NULL);
+      }
+
+      if (pl && pl->ncmds > 0 && pl->cmds[0].argv[0] != NULL) {
+         for (i = 0; slots[i]; i++)
+            ;
+         if (pinned) {
+            msh_with = &pinned[i];
          }
-         //execlp("/bin/sh", "/bin/sh", "-c", convertedArgs, NULL);  // cheatsy method
-         //execlp("ls", "ls", NULL);   executes ls
+         slots[i] = msh_job_start(pl->cmds, pl->ncmds, pl->text, 0, -1,
+                                  ncommand > 0 ? 0 : pl->pipebuf);
+         msh_with = with;
       }
+      msh_pcache_unpin(entry);
+      entry = NULL;
+      sigprocmask(SIG_SETMASK, &old, NULL);
+   }
 
-      close(fd[1]);
-      close(fd[0]);
-      waitpid(-1, NULL, 0);
-      waitpid(-1, NULL, 0);
+   msh_block_sigchld(&old);
+   while (msh_parallel_reap(slots, njobs, &failed) > 0) {
+      sigsuspend(&old);
    }
+   sigprocmask(SIG_SETMASK, &old, NULL);
 
+   free(slots);
+   free(pinned);
+   free(command);
+   msh_arena_reset(&arena);
+   free(arena.head);
+   msh_builtin_status = failed > 0;
    return 1;
 }
 
+/*
+  tee.  Input that arrives through a pipe is duplicated with tee(2) into
+  a scratch pipe per extra output and moved on with splice(2), so the
+  data never passes through the shell's memory, and the last output
+  takes the input pages themselves.  Other input, and outputs splice
+  cannot write to, fall back to read and write.
+ */
+#define MSH_TEE_MAX 64   // outputs, counting stdout
 
+struct msh_tee_out {
+   int fd;          // the output, or -1 once it has failed
+   int scratch[2];  // pipe holding the output's copy of a chunk
+};
 
-int msh_launch(char** args)
+/**
+   @brief Stop writing to an output that failed, and say why unless its
+   reader just went away.
+   @param o The output.
+ */
+static void msh_tee_drop(struct msh_tee_out* o)
 {
-   pid_t pid;
-   int status;
-
-   pid = fork();
-   if (pid == 0) {
-      // Child process
-      if (execvp(args[0], args) == -1) {
-         perror("msh");
-      }
-      exit(EXIT_FAILURE);
-   }
-   else if (pid < 0) {
-      // Error forking
-      perror("msh");
+   if (errno != EPIPE) {
+      perror("msh: tee");
+      msh_builtin_status = 1;
    }
-   else {
-      // Parent process
-      do {
-         waitpid(pid, &status, WUNTRACED);
-      } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+   if (o->fd != STDOUT_FILENO) {
+      close(o->fd);
    }
-
-   return 1;
+   o->fd = -1;
 }
 
 /**
-   @brief Execute shell built-in or launch program.
-   @param args Null terminated list of arguments.
-   @return 1 if the shell should continue running, 0 if it should terminate
+   @brief Move bytes from a pipe to an output, with splice(2) where the
+   output allows it and read and write where it does not.
+   @param from The pipe.
+   @param to The output.
+   @param n Number of bytes to move.
+   @return 0, or -1 on an error with errno set.  The bytes are consumed
+   from the pipe either way.
  */
-int msh_execute(char** args)
+static int msh_tee_move(int from, int to, size_t n)
 {
-   int i;
-
-   if (args[0] == NULL) {
-      // An empty command was entered.
-      return 1;
-   }
+   char buf[4096];
+   ssize_t r, w;
+   int failed = 0;
 
-   for (i = 0; i < msh_num_builtins(); i++) {
-      if (strcmp(args[0], builtin_str[i]) == 0) {
-         return (*builtin_func[i])(args);
+   while (n > 0) {
+      r = failed ? -1 : splice(from, NULL, to, NULL, n, SPLICE_F_MOVE);
+      if (r > 0) {
+         n -= r;
+         continue;
+      }
+      if (r < 0 && errno == EINTR) {
+         continue;
+      }
+      if (r < 0 && errno != EINVAL && !failed) {
+         failed = errno;   // drain what is left, then report
+      }
+      r = read(from, buf, n < sizeof(buf) ? n : sizeof(buf));
+      if (r <= 0) {
+         if (r < 0 && errno == EINTR) {
+            continue;
+         }
+         break;
+      }
+      n -= r;
+      for (w = 0; !failed && w < r;) {
+         ssize_t k = write(to, buf + w, r - w);
+         if (k < 0 && errno != EINTR) {
+            failed = errno;
+         }
+         w += k > 0 ? k : 0;
       }
    }
-
-   return msh_launch(args);
+   errno = failed;
+   return failed ? -1 : 0;
 }
 
 /**
-   @brief Read a line of input from stdin.
-   @return The line from stdin.
+   @brief Copy input to the outputs with read and write, for input that
+   is not a pipe.
+   @param in The input.
+   @param outs The outputs.
+   @param nouts Number of outputs.
  */
-char* msh_read_line(void)
+static void msh_tee_copy(int in, struct msh_tee_out* outs, int nouts)
 {
-#ifdef MSH_USE_STD_GETLINE
-   char* line = NULL;
-   ssize_t bufsize = 0; // have getline allocate a buffer for us
-   if (getline(&line, &bufsize, stdin) == -1) {
-      if (feof(stdin)) {
-         exit(EXIT_SUCCESS);  // We received an EOF
+   char buf[MSH_RD_BLOCKSIZE];
+   ssize_t r, w, k;
+   int i;
+
+   while ((r = read(in, buf, sizeof(buf))) != 0) {
+      if (r < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         perror("msh: tee");
+         return;
       }
-      else {
-         perror("msh: getline\n");
-         exit(EXIT_FAILURE);
+      for (i = 0; i < nouts; i++) {
+         for (w = 0; outs[i].fd >= 0 && w < r; w += k) {
+            k = write(outs[i].fd, buf + w, r - w);
+            if (k < 0 && errno == EINTR) {
+               k = 0;
+            }
+            else if (k < 0) {
+               msh_tee_drop(&outs[i]);
+            }
+         }
       }
    }
-   return line;
-#else
-#define MSH_RL_BUFSIZE 1024
-   int bufsize = MSH_RL_BUFSIZE;
-   int position = 0;
-   char* buffer = malloc(sizeof(char) * bufsize);
-   int c;
+}
 
-   if (!buffer) {
-      fprintf(stderr, "msh: allocation error\n");
-      exit(EXIT_FAILURE);
+/**
+   @brief Copy pipe input to the outputs with tee(2) and splice(2).
+   @param in The input pipe.
+   @param outs The outputs; the last one consumes the input.
+   @param nouts Number of outputs.
+   @return 0, or -1 if nothing was copied because the input is not a pipe
+   or the scratch pipes cannot be made as large as it.
+ */
+static int msh_tee_splice(int in, struct msh_tee_out* outs, int nouts)
+{
+   int size = fcntl(in, F_GETPIPE_SZ);
+   ssize_t n, m;
+   int i, last, first = 1;
+
+   if (size <= 0) {
+      return -1;
+   }
+   // Each scratch pipe is as large as the input, so tee always copies
+   // the same chunk into every one of them.
+   for (i = 0; i < nouts - 1; i++) {
+      if (pipe2(outs[i].scratch, O_CLOEXEC) < 0) {
+         perror("msh: tee");
+         return -1;
+      }
+      if (fcntl(outs[i].scratch[1], F_SETPIPE_SZ, size) != size) {
+         return -1;
+      }
    }
 
    while (1) {
-      // Read a character
-      c = getchar();
-
-      if (c == EOF) {
-         exit(EXIT_SUCCESS);
+      for (last = nouts - 1; last >= 0 && outs[last].fd < 0; last--)
+         ;
+      if (last < 0) {
+         break;   // every output has failed
       }
-      else if (c == '\n') {
-         buffer[position] = '\0';
-         return buffer;
+
+      n = 0;
+      for (i = 0; i < last; i++) {
+         if (outs[i].fd < 0) {
+            continue;
+         }
+         do {
+            m = tee(in, outs[i].scratch[1], n ? (size_t)n : (size_t)size, 0);
+         } while (m < 0 && errno == EINTR);
+         if (m < 0 && first && errno == EINVAL) {
+            return -1;   // nothing consumed yet: copy instead
+         }
+         if (m < 0 || (n && m != n)) {
+            perror("msh: tee");
+            return 0;
+         }
+         n = m;
+         if (n == 0) {
+            return 0;   // end of input
+         }
       }
-      else {
-         buffer[position] = c;
+      first = 0;
+
+      for (i = 0; i < last; i++) {
+         if (outs[i].fd >= 0 && msh_tee_move(outs[i].scratch[0], outs[i].fd, n) < 0) {
+            msh_tee_drop(&outs[i]);
+         }
       }
-      position++;
 
-      // If we have exceeded the buffer, reallocate.
-      if (position >= bufsize) {
-         bufsize += MSH_RL_BUFSIZE;
-         buffer = realloc(buffer, bufsize);
-         if (!buffer) {
-            fprintf(stderr, "msh: allocation error\n");
-            exit(EXIT_FAILURE);
+      if (n == 0) {
+         // Only one output is left: move the input straight into it.
+         do {
+            n = splice(in, NULL, outs[last].fd, NULL, size, SPLICE_F_MOVE);
+         } while (n < 0 && errno == EINTR);
+         if (n == 0) {
+            return 0;
+         }
+         if (n > 0) {
+            continue;
          }
+         if (errno != EINVAL) {
+            msh_tee_drop(&outs[last]);
+            continue;
+         }
+         n = size;   // not splice-able: let msh_tee_move copy a chunk
+      }
+      if (msh_tee_move(in, outs[last].fd, n) < 0) {
+         msh_tee_drop(&outs[last]);
       }
    }
-#endif
+   return 0;
 }
 
-#define MSH_TOK_BUFSIZE 64
-#define MSH_TOK_DELIM " \t\r\n\a"
 /**
-   @brief Split a line into tokens (very naively).
-   @param line The line.
-   @return Null-terminated array of tokens.
+   @brief Builtin command: copy stdin to stdout, to files, and to other
+   commands, without a separate tee process.
+   @param args List of args.  args[0] is "tee".  -a appends to the files
+   instead of truncating them; each -c command is started with a pipe of
+   its own as stdin, and receives a copy too.  The remaining args are
+   files.
+   @return Always returns 1, to continue executing.
  */
-char** msh_split_line(char* line)
+int msh_tee(char** args)
 {
-   int bufsize = MSH_TOK_BUFSIZE, position = 0;
-   char** tokens = malloc(bufsize * sizeof(char*));
-   char* token, ** tokens_backup;
+   struct msh_tee_out outs[MSH_TEE_MAX];
+   struct msh_job* jobs[MSH_TEE_MAX];
+   struct msh_arena arena = { NULL };
+   struct sigaction ign, old_pipe;
+   int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+   int i, k, nouts = 0, njobs = 0;
 
-   if (!tokens) {
-      fprintf(stderr, "msh: allocation error\n");
-      exit(EXIT_FAILURE);
-   }
+   memset(&ign, 0, sizeof(ign));
+   ign.sa_handler = SIG_IGN;
+   sigaction(SIGPIPE, &ign, &old_pipe);   // a reader that quits is dropped
 
-   token = strtok(line, MSH_TOK_DELIM);
-   while (token != NULL) {
-      tokens[position] = token;
-      position++;
+   for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+      if (strcmp(args[i], "--") == 0) {
+         i++;
+         break;
+      }
+      if (strcmp(args[i], "-a") == 0) {
+         flags = (flags & ~O_TRUNC) | O_APPEND;
+      }
+      else if (strcmp(args[i], "-c") == 0 && args[i + 1] != NULL) {
+         struct msh_pipeline* pl;
+         int npipes, fd[2];
 
-      if (position >= bufsize) {
-         bufsize += MSH_TOK_BUFSIZE;
-         tokens_backup = tokens;
-         tokens = realloc(tokens, bufsize * sizeof(char*));
-         if (!tokens) {
-            free(tokens_backup);
-            fprintf(stderr, "msh: allocation error\n");
-            exit(EXIT_FAILURE);
+         i++;
+         pl = msh_parse_line(msh_arena_strndup(&arena, args[i], strlen(args[i])),
+                             &arena, &npipes);
+         if (npipes != 1 || pl->background || pl->fname) {
+            if (npipes >= 0) {
+               fprintf(stderr, "msh: tee: %s: expected a single pipeline\n", args[i]);
+            }
+            msh_builtin_status = 1;
+            continue;
          }
+         if (nouts == MSH_TEE_MAX - 1 || pipe2(fd, O_CLOEXEC) < 0) {
+            fprintf(stderr, "msh: tee: %s: too many outputs\n", args[i]);
+            msh_builtin_status = 1;
+            continue;
+         }
+         jobs[njobs++] = msh_job_start(pl->cmds, pl->ncmds, pl->text, 0, fd[0],
+                                       pl->pipebuf);
+         close(fd[0]);
+         outs[nouts++].fd = fd[1];
+      }
+      else {
+         fprintf(stderr, "msh: tee: %s: unknown option\n", args[i]);
+         msh_builtin_status = 2;
+         goto done;
       }
+   }
+   for (; args[i] != NULL; i++) {
+      if (nouts == MSH_TEE_MAX - 1) {
+         fprintf(stderr, "msh: tee: %s: too many outputs\n", args[i]);
+         msh_builtin_status = 1;
+         break;
+      }
+      outs[nouts].fd = open(args[i], flags, 0666);
+      if (outs[nouts].fd < 0) {
+         fprintf(stderr, "msh: tee: %s: %s\n", args[i], strerror(errno));
+         msh_builtin_status = 1;
+         continue;
+      }
+      nouts++;
+   }
+   msh_obuf_flush(&msh_out);
+   outs[nouts++].fd = STDOUT_FILENO;
+   for (k = 0; k < nouts; k++) {
+      outs[k].scratch[0] = outs[k].scratch[1] = -1;
+   }
+
+   if (msh_tee_splice(STDIN_FILENO, outs, nouts) < 0) {
+      msh_tee_copy(STDIN_FILENO, outs, nouts);
+   }
 
-      token = strtok(NULL, MSH_TOK_DELIM);
+   for (k = 0; k < nouts; k++) {
+      if (outs[k].scratch[0] >= 0) {
+         close(outs[k].scratch[0]);
+         close(outs[k].scratch[1]);
+      }
    }
-   tokens[position] = NULL;
-   return tokens;
+   nouts--;   // stdout stays open
+done:
+   for (k = 0; k < nouts; k++) {
+      if (outs[k].fd >= 0) {
+         close(outs[k].fd);
+      }
+   }
+   for (k = 0; k < njobs; k++) {
+      msh_job_wait(jobs[k], NULL);
+   }
+   sigaction(SIGPIPE, &old_pipe, NULL);
+   msh_arena_reset(&arena);
+   free(arena.head);
+   return 1;
 }
 
 /**
@@ -380,55 +8112,22 @@ char** msh_split_line(char* line)
  */
 void msh_loop(void)
 {
+   struct msh_arena arena = { NULL };
    char *line;
-   char **args;
    int status;
-	int flag = 0;
-
-   char *token;    // new
-   char *tempLine;
 
    do {
-      printf("$ ");
-      line = tempLine = msh_read_line();
-
-      // NEW STUFF ADDED
-      while ((token = strtok_r(line, "&", &line)) && status)
-      {
-         // checks if a pipe is in the input
-         flag = 0;
-         
-         
-         // checks tempLine because line is null here already
-         if (strchr(tempLine, '|'))
-         {
-            token = tempLine;
-            flag = 1;
-         }
-
-         //printf("%s\n", token);    // used to print the current token
-         args = msh_split_line(token);
-         if (flag == 1)
-         {
-            status = msh_pipe(args);
-         }
-         else
-         {
-            status = msh_execute(args);
-         }
-         free(args);
-      }
-      // END NEW STUFF
-
-        
-      //args = msh_split_line(line);      
-      //status = msh_execute(args);
-
-      //free(line);
-      //free(args);
+      msh_job_notify();
+      line = msh_read_line(&arena);
+      msh_rc_scan();   // does its work only the first time
+      status = msh_run_line(line, &arena);
+
+      // line, tokens and pipeline data all go at once
+      msh_arena_reset(&arena);
    } while (status);
 }
 
+#ifndef MSH_NO_MAIN   // msh_bench.c includes this file for its internals
 /**
    @brief Main entry point.
    @param argc Argument count.
@@ -437,12 +8136,61 @@ void msh_loop(void)
  */
 int main(int argc, char** argv)
 {
+   if (argc == 3 && strcmp(argv[1], "--fork-server") == 0) {
+      int sock = atoi(argv[2]);   // see msh_fs_start
+
+      fcntl(sock, F_SETFD, FD_CLOEXEC);
+      msh_fs_serve(sock);
+   }
+   if (argc > 1 && strcmp(argv[1], "--stats") == 0) {
+      msh_stats_pid = getpid();
+      atexit(msh_stats_dump);
+      argv[1] = argv[0];
+      argv++;
+      argc--;
+   }
+
+   msh_cwd_get();   // adopt $PWD, or correct it, before anything runs
+
+   // Script and -c modes: no prompt, no job control, parse up front.
+   if (argc > 1) {
+      msh_init_jobs(0);
+      if (msh_spawn_backend == MSH_SPAWN_SERVER) {
+         msh_fs_start(0);   // now, while the shell is small
+      }
+      if (strcmp(argv[1], "-c") == 0) {
+         if (argc < 3) {
+            fprintf(stderr, "msh: -c: option requires an argument\n");
+            return 2;
+         }
+         if (argc > 3) {
+            msh_arg0 = argv[3];   // msh -c cmd name args...
+            msh_argv = argv + 4;
+            msh_argc = argc - 4;
+         }
+         return msh_run_script(argv[2], strlen(argv[2]), "-c");
+      }
+      msh_arg0 = argv[1];
+      msh_argv = argv + 2;
+      msh_argc = argc - 2;
+      return msh_run_file(argv[1]);
+   }
+
+   msh_init_jobs(isatty(STDIN_FILENO));
+   // Whatever the backend, so that set spawn=server finds it ready.
+   if (msh_interactive || msh_spawn_backend == MSH_SPAWN_SERVER) {
+      msh_fs_start(0);
+   }
    // Load config files, if any.
+   if (msh_interactive) {
+      msh_rc_open();
+   }
 
    // Run command loop.
    msh_loop();
 
    // Perform any shutdown/cleanup.
 
-   return EXIT_SUCCESS;
+   return msh_last.status;
 }
+#endif
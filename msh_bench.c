@@ -0,0 +1,344 @@
+/*****************************************************************************
+  @file         msh_bench.c
+  @brief        Benchmarks for the shell's own hot paths: launching
+                commands, setting up pipelines, tokenizing and reading
+                lines.
+
+  The shell is compiled into this program, so the benchmarks call its
+  internals directly and never pay for a prompt or a second shell:
+
+      gcc -O2 -o msh_bench msh_bench.c
+
+  Add -DMSH_USE_STD_GETLINE to measure the stdio reader instead of the
+  block reader.  Usage:
+
+      msh_bench [-n scale] [-m megabytes] [-e kilobytes] [benchmark...]
+
+  Benchmarks are true, pipe2, pipe4, pipe8, lex, scan and read; the first
+  four run once per spawn backend, the fork server included, and scan
+  runs once per word scanner the CPU supports, after a strtok split of
+  the same line for comparison.  -n multiplies every iteration count;
+  -m touches that much heap first, standing in for a shell that has
+  grown, after the fork server has started; -e exports that much more
+  environment, which every launch passes on.
+*******************************************************************************/
+
+#define MSH_NO_MAIN
+#include "msh.c"
+
+#define BENCH_LEX_BYTES  (1 << 20)    // length of the tokenizer's line
+#define BENCH_READ_BYTES (8 << 20)    // size of the generated script
+#define BENCH_SCAN_BYTES (1 << 20)    // length of the file-list line
+
+/**
+   @brief Current time, in seconds.
+ */
+static double bench_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+   @brief Print one result line.
+   @param name Benchmark.
+   @param variant Backend or other variant.
+   @param n Operations done.
+   @param secs Time they took.
+   @param bytes Bytes processed, or 0 to report operations only.
+ */
+static void bench_report(const char* name, const char* variant, long n, double secs,
+                         size_t bytes)
+{
+   if (bytes) {
+      printf("%-8s %-12s %10.1f MB/s %12.3f ms/pass\n", name, variant,
+             bytes / secs / 1e6, secs * 1e3 / n);
+   }
+   else {
+      printf("%-8s %-12s %10.0f op/s %12.2f us/op\n", name, variant,
+             n / secs, secs * 1e6 / n);
+   }
+   fflush(stdout);
+}
+
+/**
+   @brief Run one command line repeatedly with each spawn backend.
+   @param name Benchmark name.
+   @param line The command line; parsed once.
+   @param n Number of runs per backend.
+ */
+static void bench_launch(const char* name, const char* line, long n)
+{
+   struct msh_arena arena = { 0 };
+   struct msh_result res = { 0 };
+   struct msh_pipeline* pl;
+   int npipes, backend;
+   long i;
+   double t;
+
+   pl = msh_parse_line(msh_arena_strndup(&arena, line, strlen(line)), &arena, &npipes);
+   if (npipes != 1) {
+      return;
+   }
+   for (backend = MSH_SPAWN_POSIX; backend <= MSH_SPAWN_SERVER; backend++) {
+      msh_spawn_backend = backend;
+      msh_execute(pl, &res);   // warm the PATH cache
+      t = bench_now();
+      for (i = 0; i < n; i++) {
+         msh_execute(pl, &res);
+      }
+      bench_report(name, msh_spawn_names[backend], n, bench_now() - t, 0);
+   }
+   msh_arena_reset(&arena);
+   free(res.pipestatus);
+}
+
+/**
+   @brief Measure the tokenizer on one long line of mixed words, quotes
+   and operators.
+   @param n Number of passes.
+ */
+static void bench_lex(long n)
+{
+   static const char piece[] = "grep -v 'foo bar' \"$x\" a\\ b 2>&1 | sort >> out; ";
+   struct msh_arena arena = { 0 };
+   char* text = malloc(BENCH_LEX_BYTES + 1);
+   char* line;
+   size_t len = 0;
+   long i;
+   double t;
+
+   if (!text) {
+      fprintf(stderr, "msh_bench: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   while (len + sizeof(piece) - 1 <= BENCH_LEX_BYTES) {
+      memcpy(text + len, piece, sizeof(piece) - 1);
+      len += sizeof(piece) - 1;
+   }
+   text[len] = '\0';
+
+   t = 0;
+   for (i = 0; i < n; i++) {
+      double start;
+
+      line = msh_arena_strndup(&arena, text, len);   // lexing is in place
+      start = bench_now();
+      msh_lex(line, &arena);
+      t += bench_now() - start;
+      msh_arena_reset(&arena);
+   }
+   bench_report("lex", "", n, t, len * n);
+   free(text);
+}
+
+/**
+   @brief Measure the word scanners on one long line of file names, as
+   find output pasted into a command would make, against splitting the
+   line on blanks with strtok.
+   @param n Number of passes per variant.
+ */
+static void bench_scan(long n)
+{
+   char* text = malloc(BENCH_SCAN_BYTES + 64);
+   char* copy = malloc(BENCH_SCAN_BYTES + 64);
+   size_t len = 0, words = 0;
+   long i;
+   int k;
+   double t;
+
+   if (!text || !copy) {
+      fprintf(stderr, "msh_bench: allocation error\n");
+      exit(EXIT_FAILURE);
+   }
+   while (len < BENCH_SCAN_BYTES) {
+      len += snprintf(text + len, 64, "./src/module%zu/include/file_%zu.h ",
+                      words % 97, words);
+      words++;
+   }
+   text[len] = '\0';
+
+   t = bench_now();
+   for (i = 0; i < n; i++) {
+      char* w;
+
+      memcpy(copy, text, len + 1);   // strtok writes into the line
+      for (w = strtok(copy, " \t\r\n\a"); w; w = strtok(NULL, " \t\r\n\a"))
+         ;
+   }
+   bench_report("scan", "strtok", n, bench_now() - t, len * n);
+
+   for (k = 0; k < MSH_NUM_SCANNERS; k++) {
+      const struct msh_scanner* s = &msh_scanners[k];
+
+      if (s->usable && !s->usable()) {
+         continue;
+      }
+      t = bench_now();
+      for (i = 0; i < n; i++) {
+         const char* p = text;
+
+         while (*(p += s->scan(p)) != '\0') {
+            p++;
+         }
+      }
+      bench_report("scan", s->name, n, bench_now() - t, len * n);
+   }
+   free(text);
+   free(copy);
+}
+
+/**
+   @brief Measure the shell's input reader on a generated script read
+   through stdin.
+   @param n Number of passes.
+ */
+static void bench_read(long n)
+{
+   char path[] = "/tmp/msh_bench.XXXXXX";
+   char buf[256];
+   size_t total = 0, len;
+   int fd, saved, k = 0;
+   long i;
+   double t;
+
+   fd = mkstemp(path);
+   if (fd < 0) {
+      perror("msh_bench");
+      return;
+   }
+   unlink(path);
+   while (total < BENCH_READ_BYTES) {
+      // lines of varying length, so that some straddle two read blocks
+      int w = snprintf(buf, sizeof(buf), "echo line %d %.*s\n", k, k % 200,
+                       "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+                       "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+      if (write(fd, buf, w) != w) {
+         perror("msh_bench");
+         close(fd);
+         return;
+      }
+      total += w;
+      k++;
+   }
+
+   saved = dup(STDIN_FILENO);
+   dup2(fd, STDIN_FILENO);
+   close(fd);
+   t = bench_now();
+   for (i = 0; i < n; i++) {
+#ifdef MSH_USE_STD_GETLINE
+      rewind(stdin);
+#else
+      lseek(STDIN_FILENO, 0, SEEK_SET);
+      msh_input_discard();
+#endif
+      while (msh_input_getline(&len))
+         ;
+   }
+   t = bench_now() - t;
+   dup2(saved, STDIN_FILENO);
+   close(saved);
+#ifndef MSH_USE_STD_GETLINE
+   msh_input_discard();
+#endif
+#ifdef MSH_USE_STD_GETLINE
+   bench_report("read", "getline", n, t, total * n);
+#else
+   bench_report("read", "block", n, t, total * n);
+#endif
+}
+
+/**
+   @brief Whether a benchmark was asked for.
+   @param name The benchmark.
+   @param names Names from the command line.
+   @param count Number of names; 0 selects everything.
+ */
+static int bench_wanted(const char* name, char** names, int count)
+{
+   int i;
+
+   for (i = 0; i < count; i++) {
+      if (strcmp(names[i], name) == 0) {
+         return 1;
+      }
+   }
+   return count == 0;
+}
+
+int main(int argc, char** argv)
+{
+   long scale = 1, mb = 0, kb = 0;
+   char* ballast;
+   int i;
+
+   for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+      if (strcmp(argv[i], "-n") == 0) {
+         scale = atol(argv[i + 1]);
+      }
+      else if (strcmp(argv[i], "-m") == 0) {
+         mb = atol(argv[i + 1]);
+      }
+      else if (strcmp(argv[i], "-e") == 0) {
+         kb = atol(argv[i + 1]);
+      }
+      else {
+         break;
+      }
+      if (scale < 1 || mb < 0 || kb < 0) {
+         fprintf(stderr, "msh_bench: %s: bad value\n", argv[i]);
+         return 2;
+      }
+   }
+   argv += i;
+   argc -= i;
+
+   msh_init_jobs(0);
+   msh_fs_start(0);
+   if (mb > 0) {
+      ballast = malloc(mb << 20);
+      if (!ballast) {
+         fprintf(stderr, "msh_bench: allocation error\n");
+         exit(EXIT_FAILURE);
+      }
+      memset(ballast, 1, mb << 20);
+   }
+   for (i = 0; i < kb; i++) {
+      char name[32], value[1024 - 32];
+
+      // about a kilobyte each, as a long PATH-like entry would be
+      snprintf(name, sizeof(name), "BENCH_ENV_%d", i);
+      memset(value, 'x', sizeof(value) - 1);
+      value[sizeof(value) - 1] = '\0';
+      msh_var_set(name, value, MSH_VAR_EXPORT);
+   }
+   if (bench_wanted("true", argv, argc)) {
+      // by path, so the true builtin does not answer instead
+      bench_launch("true", "/bin/true", 2000 * scale);
+   }
+   if (bench_wanted("pipe2", argv, argc)) {
+      bench_launch("pipe2", "/bin/true | /bin/true", 1000 * scale);
+   }
+   if (bench_wanted("pipe4", argv, argc)) {
+      bench_launch("pipe4", "/bin/true | /bin/true | /bin/true | /bin/true",
+                   500 * scale);
+   }
+   if (bench_wanted("pipe8", argv, argc)) {
+      bench_launch("pipe8", "/bin/true | /bin/true | /bin/true | /bin/true | "
+                   "/bin/true | /bin/true | /bin/true | /bin/true",
+                   250 * scale);
+   }
+   if (bench_wanted("lex", argv, argc)) {
+      bench_lex(20 * scale);
+   }
+   if (bench_wanted("scan", argv, argc)) {
+      bench_scan(50 * scale);
+   }
+   if (bench_wanted("read", argv, argc)) {
+      bench_read(5 * scale);
+   }
+   return EXIT_SUCCESS;
+}